@@ -0,0 +1,338 @@
+#include "consolespreadsheet.h"
+
+/*
+    The dependency analysis (--analyze). Tuning a large sheet starts with knowing its shape, so this reads the sheet and builds the same dependency graph the
+    evaluation uses - from the same compiled references - and reports on it instead of evaluating it:
+
+    - the critical path, the longest chain of formulas each waiting on the one before. However many threads there are, evaluation cannot take fewer steps.
+    - the width of every level of the evaluation schedule (see scheduleLevels), which is how much there is to do in parallel at each step
+    - fan-in (the cells each formula reads) and fan-out (the formulas reading each cell), as histograms and as the cells with the most of each
+    - the cells in cycles, the formulas the cycles reference, and how many formulas end up #ERROR because they reference a cycle
+
+    Every part is a single pass over the nodes and references of the graph (or over the compiled code), so a sheet with millions of cells takes about as
+    long to analyze as it takes to build its graph. The graph itself can also be written out, as a DOT file for Graphviz or as JSON (--graph).
+*/
+
+static int bucketOf(long long count) {
+
+    /* Histogram buckets double in size - 0, 1, 2-3, 4-7, 8-15 and so on - so a few lines cover anything from a single reference to millions */
+
+    int bucket = 0;
+    while (count > 0) {
+        bucket++;
+        count >>= 1;
+    }
+    return bucket;
+}
+
+static string bucketName(int bucket) {
+    if (bucket <= 1) return to_string(bucket);
+    return to_string(1LL << (bucket - 1)) + "-" + to_string((1LL << bucket) - 1);
+}
+
+string graphNodeName(const Sheet& sheet, int node) {
+    const CompiledFormulas& program = sheet.formulas;
+    if (node < program.row.size()) return program.row[node] < 0 ? "" : cellName(program.row[node], program.column[node]);
+
+    /* A range node stands for the rows of its column that it summarizes. Node 1 of a tree is the whole column, and every level down halves the rows. Node 0
+        of each tree and the nodes past the last row of the sheet are never used */
+
+    const RangeIndex& index = sheet.rangeIndex;
+    int rangeNode = node - program.row.size();
+    int tree = rangeNode / (2 * index.leafCount);
+    int i = rangeNode % (2 * index.leafCount);
+    if (i == 0) return "";
+
+    int level = 0;
+    while ((2 << level) <= i) level++;
+    long long blockCount = index.leafCount >> level;
+    long long firstRow = (i - (1LL << level)) * blockCount * rangeBlockRows;
+    if (firstRow >= sheet.rowCount) return "";
+    int lastRow = (int)min((long long)sheet.rowCount, firstRow + blockCount * rangeBlockRows) - 1;
+    return cellName((int)firstRow, index.columnOf[tree]) + ":" + cellName(lastRow, index.columnOf[tree]);
+}
+
+SheetAnalysis analyzeSheet(const Sheet& sheet, const DependencyGraph& graph, const vector<int>& order, const vector<char>& circular) {
+    SheetAnalysis analysis;
+    const CompiledFormulas& program = sheet.formulas;
+    int formulaCount = program.row.size();
+    int nodeCount = graph.referenceStart.size() - 1;
+    analysis.edgeCount = graph.references.size();
+
+    /* The critical path. In evaluation order, everything a node references already knows the longest chain ending at it, so each node only has to pick the
+        longest of those and remember which one it was (via) - following via back from the end of the longest chain gives its cells. Range nodes are part of
+        the chain but are not counted, and cells in cycles are left out - they never wait for anything, they just become #ERROR */
+
+    vector<int> depth(nodeCount, 0), via(nodeCount, -1);
+    int last = -1;
+    for (int i = 0; i < order.size(); i++) {
+        int node = order[i];
+        if (circular[node]) continue;
+        for (int k = graph.referenceStart[node]; k < graph.referenceStart[node + 1]; k++) {
+            int reference = graph.references[k];
+            if (reference == node || circular[reference] || depth[reference] <= depth[node]) continue;
+            depth[node] = depth[reference];
+            via[node] = reference;
+        }
+        if (node >= formulaCount) continue;
+        if (program.row[node] >= 0) depth[node]++;
+        if (last < 0 || depth[node] > depth[last]) last = node;
+    }
+    for (int node = last; node >= 0; node = via[node]) {
+        if (node < formulaCount) analysis.criticalPath.push_back(node);
+    }
+    reverse(analysis.criticalPath.begin(), analysis.criticalPath.end());
+
+    LevelSchedule schedule = scheduleLevels(graph, order, program);
+    for (int l = 0; l + 1 < schedule.levelStart.size(); l++) analysis.levelWidths.push_back(schedule.levelStart[l + 1] - schedule.levelStart[l]);
+
+    /* Fan-in and fan-out come straight from the compiled code. A range adds every cell in it to the fan-in of its formula, but adding the formula to the
+        fan-out of every one of those cells would take as long as the ranges are big - so each range only marks where it starts and ends in each of its
+        columns, and one running sum down every marked column then adds it to all of its cells at once */
+
+    analysis.fanIn.assign(formulaCount, 0);
+    analysis.fanOut.resize(sheet.columnCount);
+    for (int j = 0; j < sheet.columnCount; j++) analysis.fanOut[j].assign(sheet.columns[j].tags.size(), 0);
+    vector<vector<int>> rangeEdges(sheet.columnCount);
+
+    for (int formula = 0; formula < formulaCount; formula++) {
+        if (program.row[formula] < 0) continue;
+        FormulaCode code = formulaCode(program, formula);
+        for (int k = code.begin; k < code.end; k++) {
+            const Instruction& instruction = program.code[k];
+            if (instruction.op == OP_PUSH_CELL) {
+                analysis.fanIn[formula]++;
+                int index = cellIndex(sheet.columns[instruction.column], instruction.row + code.rowOffset);
+                if (index >= 0) analysis.fanOut[instruction.column][index]++;
+            }
+            if (!isRangeFunction(instruction.op)) continue;
+
+            const CellRange& range = program.ranges[instruction.row];
+            analysis.fanIn[formula] += (long long)(range.lastRow - range.firstRow + 1) * (range.lastColumn - range.firstColumn + 1);
+            for (int j = range.firstColumn; j <= range.lastColumn; j++) {
+                if (rangeEdges[j].empty()) rangeEdges[j].assign(sheet.rowCount + 1, 0);
+                rangeEdges[j][range.firstRow + code.rowOffset]++;
+                rangeEdges[j][range.lastRow + code.rowOffset + 1]--;
+            }
+        }
+    }
+    for (int j = 0; j < sheet.columnCount; j++) {
+        if (rangeEdges[j].empty()) continue;
+        const Column& cells = sheet.columns[j];
+        for (int i = 1; i <= sheet.rowCount; i++) rangeEdges[j][i] += rangeEdges[j][i - 1];
+        for (int k = 0; k < cells.tags.size(); k++) analysis.fanOut[j][k] += rangeEdges[j][cells.sparse ? cells.rows[k] : k];
+        vector<int>().swap(rangeEdges[j]);
+    }
+
+    /* Cycles. Everything a cycle references (directly or through other formulas) is found by following references out of the cycles, and everything that
+        references a cycle by following them backwards - which needs the graph turned around first, once */
+
+    vector<char> reached(nodeCount, 0);
+    vector<int> pending;
+    for (int node = 0; node < nodeCount; node++) {
+        if (!circular[node]) continue;
+        if (node < formulaCount && program.row[node] >= 0) analysis.cycleCells.push_back(node);
+        reached[node] = 1;
+        pending.push_back(node);
+    }
+    while (!pending.empty()) {
+        int node = pending.back();
+        pending.pop_back();
+        for (int k = graph.referenceStart[node]; k < graph.referenceStart[node + 1]; k++) {
+            int reference = graph.references[k];
+            if (reached[reference]) continue;
+            reached[reference] = 1;
+            pending.push_back(reference);
+            if (reference < formulaCount) analysis.feedingCells.push_back(reference);
+        }
+    }
+    sort(analysis.feedingCells.begin(), analysis.feedingCells.end());
+
+    if (!analysis.cycleCells.empty()) {
+        vector<int> readerStart(nodeCount + 1, 0), readers(graph.references.size());
+        for (int k = 0; k < graph.references.size(); k++) readerStart[graph.references[k] + 1]++;
+        for (int node = 0; node < nodeCount; node++) readerStart[node + 1] += readerStart[node];
+        vector<int> nextReader(readerStart.begin(), readerStart.end() - 1);
+        for (int node = 0; node < nodeCount; node++) {
+            for (int k = graph.referenceStart[node]; k < graph.referenceStart[node + 1]; k++) readers[nextReader[graph.references[k]]++] = node;
+        }
+
+        reached.assign(nodeCount, 0);
+        for (int node = 0; node < nodeCount; node++) {
+            if (!circular[node]) continue;
+            reached[node] = 1;
+            pending.push_back(node);
+        }
+        while (!pending.empty()) {
+            int node = pending.back();
+            pending.pop_back();
+            for (int k = readerStart[node]; k < readerStart[node + 1]; k++) {
+                int reader = readers[k];
+                if (reached[reader]) continue;
+                reached[reader] = 1;
+                pending.push_back(reader);
+                if (reader < formulaCount && program.row[reader] >= 0) analysis.affectedCount++;
+            }
+        }
+    }
+
+    return analysis;
+}
+
+void printAnalysis(const Sheet& sheet, const SheetAnalysis& analysis, int topCount) {
+    const CompiledFormulas& program = sheet.formulas;
+    int formulaCount = 0;
+    for (int formula = 0; formula < program.row.size(); formula++) {
+        if (program.row[formula] >= 0) formulaCount++;
+    }
+
+    cout << "{" << endl;
+    cout << "  \"rows\": " << sheet.rowCount << ", \"columns\": " << sheet.columnCount << ", \"formulas\": " << formulaCount << ", \"rangeNodes\": " << sheet.rangeIndex.summaries.size();
+    cout << ", \"references\": " << analysis.edgeCount << "," << endl;
+
+    cout << "  \"criticalPath\": { \"length\": " << analysis.criticalPath.size() << ", \"cells\": [";
+    for (int i = 0; i < analysis.criticalPath.size(); i++) cout << (i > 0 ? ", " : "") << "\"" << graphNodeName(sheet, analysis.criticalPath[i]) << "\"";
+    cout << "] }," << endl;
+
+    /* The widths are written as runs of [width, number of levels] - a long chain would otherwise be a million 1s */
+
+    int widest = 0;
+    for (int l = 0; l < analysis.levelWidths.size(); l++) widest = max(widest, analysis.levelWidths[l]);
+    cout << "  \"levels\": { \"count\": " << analysis.levelWidths.size() << ", \"maxWidth\": " << widest << ", \"widths\": [";
+    for (int l = 0; l < analysis.levelWidths.size();) {
+        int run = l;
+        while (run < analysis.levelWidths.size() && analysis.levelWidths[run] == analysis.levelWidths[l]) run++;
+        cout << (l > 0 ? ", " : "") << "[" << analysis.levelWidths[l] << ", " << run - l << "]";
+        l = run;
+    }
+    cout << "] }," << endl;
+
+    /* Fan-in is counted for every formula, and fan-out for every filled cell */
+
+    vector<long long> histogram;
+    vector<int> top;
+    for (int formula = 0; formula < program.row.size(); formula++) {
+        if (program.row[formula] < 0) continue;
+        int bucket = bucketOf(analysis.fanIn[formula]);
+        if (bucket >= histogram.size()) histogram.resize(bucket + 1, 0);
+        histogram[bucket]++;
+        top.push_back(formula);
+    }
+    int shown = min(topCount, (int)top.size());
+    partial_sort(top.begin(), top.begin() + shown, top.end(), [&](int a, int b) {
+        return analysis.fanIn[a] != analysis.fanIn[b] ? analysis.fanIn[a] > analysis.fanIn[b] : a < b;    // ties in the order of the file
+    });
+
+    cout << "  \"fanIn\": { \"histogram\": {";
+    for (int b = 0; b < histogram.size(); b++) cout << (b > 0 ? ", " : " ") << "\"" << bucketName(b) << "\": " << histogram[b];
+    cout << " }, \"top\": [";
+    for (int i = 0; i < shown; i++) cout << (i > 0 ? ", " : "") << "{ \"cell\": \"" << graphNodeName(sheet, top[i]) << "\", \"cells\": " << analysis.fanIn[top[i]] << " }";
+    cout << "] }," << endl;
+
+    histogram.clear();
+    vector<CellPosition> readCells;
+    for (int j = 0; j < sheet.columnCount; j++) {
+        const Column& cells = sheet.columns[j];
+        for (int k = 0; k < cells.tags.size(); k++) {
+            if (tagKind(cells.tags[k]) == CELL_EMPTY) continue;
+            int bucket = bucketOf(analysis.fanOut[j][k]);
+            if (bucket >= histogram.size()) histogram.resize(bucket + 1, 0);
+            histogram[bucket]++;
+            if (analysis.fanOut[j][k] > 0) readCells.push_back({ k, j });    // row holds the position in the column for now
+        }
+    }
+    shown = min(topCount, (int)readCells.size());
+    partial_sort(readCells.begin(), readCells.begin() + shown, readCells.end(), [&](const CellPosition& a, const CellPosition& b) {
+        int x = analysis.fanOut[a.column][a.row], y = analysis.fanOut[b.column][b.row];
+        return x != y ? x > y : (a.column != b.column ? a.column < b.column : a.row < b.row);
+    });
+
+    cout << "  \"fanOut\": { \"histogram\": {";
+    for (int b = 0; b < histogram.size(); b++) cout << (b > 0 ? ", " : " ") << "\"" << bucketName(b) << "\": " << histogram[b];
+    cout << " }, \"top\": [";
+    for (int i = 0; i < shown; i++) {
+        const Column& cells = sheet.columns[readCells[i].column];
+        int row = cells.sparse ? cells.rows[readCells[i].row] : readCells[i].row;
+        cout << (i > 0 ? ", " : "") << "{ \"cell\": \"" << cellName(row, readCells[i].column) << "\", \"formulas\": " << analysis.fanOut[readCells[i].column][readCells[i].row] << " }";
+    }
+    cout << "] }," << endl;
+
+    /* Only the first topCount cells of each list are named - a sheet full of cycles would otherwise print most of itself */
+
+    cout << "  \"cycles\": { \"cells\": " << analysis.cycleCells.size() << ", \"members\": [";
+    for (int i = 0; i < min(topCount, (int)analysis.cycleCells.size()); i++) cout << (i > 0 ? ", " : "") << "\"" << graphNodeName(sheet, analysis.cycleCells[i]) << "\"";
+    cout << "], \"feeding\": " << analysis.feedingCells.size() << ", \"feedingCells\": [";
+    for (int i = 0; i < min(topCount, (int)analysis.feedingCells.size()); i++) cout << (i > 0 ? ", " : "") << "\"" << graphNodeName(sheet, analysis.feedingCells[i]) << "\"";
+    cout << "], \"affected\": " << analysis.affectedCount << " }" << endl;
+    cout << "}" << endl;
+}
+
+bool writeGraph(const Sheet& sheet, const DependencyGraph& graph, const string& fileName) {
+    ofstream output(fileName, ios::binary);
+    if (!output) return false;
+
+    /* Edges point the way values flow - from a cell to the formula that references it. Removed formulas and unused range nodes are left out. The output
+        is built up in a buffer and written a chunk at a time */
+
+    bool dot = fileName.size() >= 4 && fileName.compare(fileName.size() - 4, 4, ".dot") == 0;
+    int nodeCount = graph.referenceStart.size() - 1;
+    int formulaCount = sheet.formulas.row.size();
+    vector<string> names(nodeCount);
+    for (int node = 0; node < nodeCount; node++) names[node] = graphNodeName(sheet, node);
+
+    string buffer = dot ? "digraph sheet {\n" : "{\n  \"nodes\": [";
+    bool first = true;
+    for (int node = 0; node < nodeCount; node++) {
+        if (names[node].empty()) continue;
+        if (dot) buffer += "  \"" + names[node] + "\"" + (node < formulaCount ? "" : " [shape=box]") + ";\n";
+        else buffer += string(first ? "\n" : ",\n") + "    { \"id\": " + to_string(node) + ", \"" + (node < formulaCount ? "cell" : "range") + "\": \"" + names[node] + "\" }";
+        first = false;
+        if (buffer.size() >= outputChunkBytes) {
+            output.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    if (!dot) buffer += "\n  ],\n  \"edges\": [";
+    first = true;
+    for (int node = 0; node < nodeCount; node++) {
+        if (names[node].empty()) continue;
+        for (int k = graph.referenceStart[node]; k < graph.referenceStart[node + 1]; k++) {
+            int reference = graph.references[k];
+            if (names[reference].empty()) continue;
+            if (dot) buffer += "  \"" + names[reference] + "\" -> \"" + names[node] + "\";\n";
+            else buffer += string(first ? "\n" : ",\n") + "    [" + to_string(reference) + ", " + to_string(node) + "]";
+            first = false;
+        }
+        if (buffer.size() >= outputChunkBytes) {
+            output.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    buffer += dot ? "}\n" : "\n  ]\n}\n";
+    output.write(buffer.data(), buffer.size());
+    return output.good();
+}
+
+int runAnalysis(const Options& options) {
+    SpreadsheetData data = getDataFromSpreadsheet(options.inputFileName, options.threadCount);
+    if (!data.file) {
+        cerr << "Could not read " << options.inputFileName << endl;
+        return 1;
+    }
+    Sheet sheet = separateRows(data, options.threadCount);
+
+    /* Everything evaluation would do up to the point of evaluating anything */
+
+    buildRangeIndex(sheet);
+    DependencyGraph graph = buildDependencyGraph(sheet);
+    vector<char> circular;
+    vector<int> order = topologicalOrder(graph, circular);
+
+    printAnalysis(sheet, analyzeSheet(sheet, graph, order, circular), options.topCount);
+    if (!options.graphFileName.empty() && !writeGraph(sheet, graph, options.graphFileName)) {
+        cerr << "Could not write the graph " << options.graphFileName << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,457 @@
+#include "consolespreadsheet.h"
+#include <cstring>
+#include <cstdio>
+
+/*
+    Evaluation in bands of rows, for sheets too large to hold in memory (--memory-budget). The input file is cut into bands of consecutive rows, and only one
+    band's cells are ever loaded into a sheet at a time. A first pass reads every band once to find the size of the sheet and which rows of other bands each
+    band's formulas reference. The bands are then evaluated in dependency order (for a ledger, where every row only looks at the rows above it, that is simply
+    top to bottom): the band's own cells are loaded along with the calculated values of just the rows it references, its formulas are evaluated, and its rows
+    are written to the output. The calculated values of a band are kept for as long as a later band still needs them - in memory while they fit in what is
+    left of the budget, otherwise in a temporary spill file, from where they are read back when needed. The input file's pages are handed back to
+    the operating system as soon as a band is done with them.
+
+    The budget is planned before anything is evaluated. A band takes rows until its own cells would cost a quarter of the budget (bandCellBytes each, plus
+    its text twice - its pages of the input and its formatted output). After the first pass the cost of the largest window - a band with the cells of the
+    rows it needs - and of the records kept for every band (the rows it needs) is known, and whatever is left is what the kept values may use. A sheet whose
+    references are scattered so widely that this does not fit is refused with an error, rather than quietly using more than it was given.
+
+    Bands that reference each other in both directions cannot be evaluated one after the other, so they are merged into a single band (along with the bands
+    between them), as many times over as it takes for no two bands to do so - which costs more memory, and is checked against the budget like any band.
+*/
+
+static void addOutsideRows(RowSpan span, const RowBand& band, vector<RowSpan>& needs) {
+
+    /* The band's own rows are loaded anyway, so only the parts of a span outside of them are needed */
+
+    int bandEnd = band.firstRow + band.rowCount;
+    if (span.firstRow < band.firstRow) needs.push_back({ span.firstRow, min(span.lastRow, band.firstRow - 1) });
+    if (span.lastRow >= bandEnd) needs.push_back({ max(span.firstRow, bandEnd), span.lastRow });
+}
+
+static void addNeededRows(const CompiledFormulas& program, int codeStart, const RowBand& band, vector<RowSpan>& needs) {
+    for (int k = codeStart; k < program.code.size(); k++) {
+        const Instruction& instruction = program.code[k];
+        RowSpan span;
+        if (instruction.op == OP_PUSH_CELL) span = { instruction.row, instruction.row };
+        else if (isRangeFunction(instruction.op)) span = { program.ranges[instruction.row].firstRow, program.ranges[instruction.row].lastRow };
+        else continue;
+        addOutsideRows(span, band, needs);
+    }
+}
+
+static void mergeSpans(vector<RowSpan>& spans) {
+    sort(spans.begin(), spans.end(), [](const RowSpan& a, const RowSpan& b) { return a.firstRow < b.firstRow; });
+    int count = 0;
+    for (int k = 0; k < spans.size(); k++) {
+        if (count > 0 && spans[k].firstRow <= spans[count - 1].lastRow + 1) spans[count - 1].lastRow = max(spans[count - 1].lastRow, spans[k].lastRow);
+        else spans[count++] = spans[k];
+    }
+    spans.resize(count);
+    spans.shrink_to_fit();
+}
+
+static bool scanBands(const shared_ptr<MappedFile>& file, long long bandLimit, long long recordLimit, vector<RowBand>& bands, int& rowCount, int& columnCount) {
+    rowCount = columnCount = 0;
+    long long recordBytes = 0;
+    CompiledFormulas program;
+
+    for (long long begin = 0; begin < file->size;) {
+
+        /* A band takes rows for as long as their cost stays within bandLimit - every row costs its bytes twice and bandCellBytes for every cell, counted as
+            one more than its delimiters so that empty cells count too. A band always has at least one row, however long it is */
+
+        long long end = begin, cost = 0;
+        while (end < file->size) {
+            const char* row = file->data + end;
+            const char* newline = (const char*)memchr(row, '\n', file->size - end);
+            long long rowEnd = newline == NULL ? file->size : newline - file->data + 1;
+            long long rowCost = 2 * (rowEnd - end) + bandCellBytes * (count(row, file->data + rowEnd, delimiter) + 1);
+            if (end > begin && cost + rowCost > bandLimit) break;
+            cost += rowCost;
+            end = rowEnd;
+        }
+
+        SpreadsheetData data;
+        data.file = file;
+        data.rowStart.push_back(0);
+        tokenizeRows(data, begin, end);
+
+        RowBand band;
+        band.begin = begin;
+        band.end = end;
+        band.firstRow = rowCount;
+        band.rowCount = data.rowStart.size() - 1;
+        band.cellCount = data.cells.size();
+
+        /* The size of the sheet is not known yet, so every reference is compiled as if it were inside of it - the ones that turn out not to be are simply
+            never found in any band */
+
+        for (long long k = 0; k < data.cells.size(); k++) {
+            const char* s = file->data + data.cells[k].offset;
+            if (s[0] != '=') continue;
+            compileFormula(s, data.cells[k].length, INT_MAX, INT_MAX, program);
+            addNeededRows(program, 0, band, band.needs);
+            program.code.clear();
+            program.constants.clear();
+            program.ranges.clear();
+        }
+        mergeSpans(band.needs);
+
+        /* The records of the bands are kept until the end, so once they alone take more than recordLimit (the budget less a band being read) it cannot be
+            kept whatever happens next */
+
+        recordBytes += sizeof(RowBand) + band.needs.capacity() * sizeof(RowSpan);
+        if (recordBytes > recordLimit) return false;
+
+        bands.push_back(band);
+        rowCount += band.rowCount;
+        columnCount = max(columnCount, data.maxWidth);
+        releaseFileRange(*file, begin, end);
+        begin = end;
+    }
+    return true;
+}
+
+static int bandOf(const vector<RowBand>& bands, int row) {
+    int low = 0, high = bands.size() - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (bands[middle].firstRow <= row) low = middle;
+        else high = middle - 1;
+    }
+    return low;
+}
+
+static DependencyGraph bandGraph(const vector<RowBand>& bands, int rowCount) {
+
+    /* The bands form a dependency graph of their own, with an edge to every band whose rows a band needs */
+
+    DependencyGraph graph;
+    for (int b = 0; b < bands.size(); b++) {
+        graph.referenceStart.push_back(graph.references.size());
+        for (int s = 0; s < bands[b].needs.size(); s++) {
+            if (bands[b].needs[s].firstRow >= rowCount) continue;
+            int last = bandOf(bands, min(bands[b].needs[s].lastRow, rowCount - 1));
+            for (int d = bandOf(bands, bands[b].needs[s].firstRow); d <= last; d++) {
+                if (d != b && (graph.references.size() == graph.referenceStart.back() || graph.references.back() != d)) graph.references.push_back(d);
+            }
+        }
+    }
+    graph.referenceStart.push_back(graph.references.size());
+    return graph;
+}
+
+static void mergeBands(vector<RowBand>& bands, int first, int last) {
+
+    /* The bands first .. last become one band. The rows of the bands merged in are its own rows now, so they are cut out of what it needs */
+
+    RowBand& band = bands[first];
+    vector<RowSpan> needs;
+    for (int b = first + 1; b <= last; b++) {
+        band.end = bands[b].end;
+        band.rowCount += bands[b].rowCount;
+        band.cellCount += bands[b].cellCount;
+    }
+    for (int b = first; b <= last; b++) {
+        for (int s = 0; s < bands[b].needs.size(); s++) addOutsideRows(bands[b].needs[s], band, needs);
+    }
+    mergeSpans(needs);
+    band.needs.swap(needs);
+    bands.erase(bands.begin() + first + 1, bands.begin() + last + 1);
+}
+
+static long long keptBytes(const RowBand& band, int columnCount) {
+    return band.cellCount * (sizeof(int) + 1 + sizeof(long long)) + columnCount * sizeof(Column);
+}
+
+static long long windowBytes(const vector<RowBand>& bands, const RowBand& band, int rowCount, int columnCount) {
+
+    /* What evaluating the band takes: its own cells and text, the cells of the rows it needs (counted at the average of the bands they are in), and what it
+        keeps of its own values. The buffers for a band read back from the spill file and for copying output out of it are added by the caller */
+
+    long long neededCells = 0;
+    for (int s = 0; s < band.needs.size(); s++) {
+        int firstRow = band.needs[s].firstRow, lastRow = min(band.needs[s].lastRow, rowCount - 1);
+        if (firstRow > lastRow) continue;    // rows past the end of the sheet are never found
+        for (int b = bandOf(bands, firstRow); b < bands.size() && bands[b].firstRow <= lastRow; b++) {
+            long long overlap = min(lastRow, bands[b].firstRow + bands[b].rowCount - 1) - max(firstRow, bands[b].firstRow) + 1;
+            neededCells += (bands[b].cellCount * overlap + bands[b].rowCount - 1) / bands[b].rowCount;
+        }
+    }
+    return 2 * (band.end - band.begin) + band.cellCount * bandCellBytes + neededCells * neededCellBytes + keptBytes(band, columnCount);
+}
+
+static long long spillBand(fstream& spill, long long& spillEnd, const vector<Column>& values) {
+
+    /* Every column as its number of cells followed by their rows, tags and values */
+
+    long long offset = spillEnd;
+    spill.seekp(offset);
+    for (int j = 0; j < values.size(); j++) {
+        long long count = values[j].rows.size();
+        spill.write((const char*)&count, sizeof(count));
+        spill.write((const char*)values[j].rows.data(), count * sizeof(int));
+        spill.write((const char*)values[j].tags.data(), count);
+        spill.write((const char*)values[j].values.data(), count * sizeof(long long));
+        spillEnd += sizeof(count) + count * (sizeof(int) + 1 + sizeof(long long));
+    }
+    return offset;
+}
+
+static void readSpilledBand(fstream& spill, long long offset, int columnCount, vector<Column>& values) {
+    spill.seekg(offset);
+    values.assign(columnCount, Column());
+    for (int j = 0; j < columnCount; j++) {
+        long long count = 0;
+        spill.read((char*)&count, sizeof(count));
+        values[j].sparse = true;
+        values[j].rows.resize(count);
+        values[j].tags.resize(count);
+        values[j].values.resize(count);
+        spill.read((char*)values[j].rows.data(), count * sizeof(int));
+        spill.read((char*)values[j].tags.data(), count);
+        spill.read((char*)values[j].values.data(), count * sizeof(long long));
+    }
+}
+
+static void loadNeededRows(Sheet& window, vector<RowBand>& bands, const RowBand& band, bool before, fstream& spill, int& spilledBand, vector<Column>& spilled) {
+
+    /* Copies the calculated cells of the rows the band needs from the bands they belong to, in row order, so that every column only ever has cells added to
+        its end. The cells are only values now - a formula from another band is never evaluated again, it is just read */
+
+    for (int s = 0; s < band.needs.size(); s++) {
+        RowSpan span = band.needs[s];
+        if ((span.lastRow < band.firstRow) != before) continue;
+        span.lastRow = min(span.lastRow, window.rowCount - 1);
+
+        for (int b = bandOf(bands, span.firstRow); b < bands.size() && bands[b].firstRow <= span.lastRow && span.firstRow < window.rowCount; b++) {
+            const vector<Column>* values = &bands[b].values;
+            if (!bands[b].resident) {
+                if (spilledBand != b) readSpilledBand(spill, bands[b].spillOffset, window.columnCount, spilled);
+                spilledBand = b;
+                values = &spilled;
+            }
+
+            for (int j = 0; j < window.columnCount; j++) {
+                const Column& source = (*values)[j];
+                int k = lower_bound(source.rows.begin(), source.rows.end(), span.firstRow) - source.rows.begin();
+                for (; k < source.rows.size() && source.rows[k] <= span.lastRow; k++) {
+                    Column& cells = window.columns[j];
+                    int index = storeCell(cells, source.rows[k]);
+                    cells.tags[index] = source.tags[k];
+                    cells.values[index] = source.values[k];
+                }
+            }
+        }
+    }
+}
+
+static long long keepBandValues(const Sheet& window, RowBand& band) {
+
+    /* Only what a reference to a cell reads is kept - its tag and value. A text cell's value is the index of its text in this window, which means nothing
+        outside of it, so it is dropped */
+
+    long long bytes = window.columnCount * sizeof(Column);
+    band.values.assign(window.columnCount, Column());
+    for (int j = 0; j < window.columnCount; j++) {
+        const Column& cells = window.columns[j];
+        Column& values = band.values[j];
+        values.sparse = true;
+        int k = lower_bound(cells.rows.begin(), cells.rows.end(), band.firstRow) - cells.rows.begin();
+        int end = lower_bound(cells.rows.begin(), cells.rows.end(), band.firstRow + band.rowCount) - cells.rows.begin();
+        values.rows.reserve(end - k);    // exactly as much as keptBytes planned for
+        values.tags.reserve(end - k);
+        values.values.reserve(end - k);
+        for (; k < end; k++) {
+            if (tagKind(cells.tags[k]) == CELL_EMPTY) continue;
+            values.rows.push_back(cells.rows[k]);
+            values.tags.push_back(cells.tags[k]);
+            values.values.push_back(tagKind(cells.tags[k]) == CELL_TEXT ? 0 : cells.values[k]);
+        }
+        bytes += values.rows.capacity() * sizeof(int) + values.tags.capacity() + values.values.capacity() * sizeof(long long);
+    }
+    band.resident = true;
+    band.residentBytes = bytes;
+    return bytes;
+}
+
+static void copySpilledOutput(fstream& spill, const RowBand& band, ofstream& output) {
+    string buffer;
+    spill.seekg(band.outputOffset);
+    for (long long copied = 0; copied < band.outputLength; copied += buffer.size()) {
+        buffer.resize(min(outputChunkBytes, band.outputLength - copied));
+        spill.read(&buffer[0], buffer.size());
+        output.write(buffer.data(), buffer.size());
+    }
+}
+
+int runBanded(const Options& options) {
+    shared_ptr<MappedFile> file = mapFile(options.inputFileName);
+    long long budget = options.memoryBudget;
+
+    vector<RowBand> bands;
+    int rowCount = 0, columnCount = 0;
+    if (file && file->size > 0 && !scanBands(file, budget / 4, budget - processBytes - budget / 4, bands, rowCount, columnCount)) {
+        cerr << "A memory budget of " << (budget >> 20) << " MB is too small for this sheet" << endl;
+        return 1;
+    }
+
+    /* Evaluating the bands in the order of their graph means every band's references are calculated before it. Bands in a cycle are merged, along with
+        every band between them, until there are no cycles left - at worst that is the whole sheet as one band */
+
+    DependencyGraph graph;
+    vector<char> circular;
+    vector<int> order;
+    while (true) {
+        graph = bandGraph(bands, rowCount);
+        order = topologicalOrder(graph, circular);
+        if (find(circular.begin(), circular.end(), 1) == circular.end()) break;
+
+        vector<pair<int, int>> merges;
+        for (int b = 0; b < bands.size(); b++) {
+            for (int k = graph.referenceStart[b]; k < graph.referenceStart[b + 1]; k++) {
+                int d = graph.references[k];
+                if (circular[b] && circular[d]) merges.push_back(make_pair(min(b, d), max(b, d)));
+            }
+        }
+        sort(merges.begin(), merges.end());
+        int count = 0;
+        for (int m = 0; m < merges.size(); m++) {
+            if (count > 0 && merges[m].first <= merges[count - 1].second) merges[count - 1].second = max(merges[count - 1].second, merges[m].second);
+            else merges[count++] = merges[m];
+        }
+        for (int m = count - 1; m >= 0; m--) mergeBands(bands, merges[m].first, merges[m].second);
+    }
+
+    /* The plan: the records of the bands, and the largest window along with room for a band read back from the spill file and for copying output, all
+        have to fit - and what is left of the budget is how much of the kept values stay in memory */
+
+    long long recordBytes = bands.capacity() * sizeof(RowBand) + (graph.references.capacity() + graph.referenceStart.capacity()) * sizeof(int);
+    recordBytes += bands.size() * (2 * sizeof(int) + 1);    // order, position and circular
+    long long largestKept = 0, largestWindow = 0;
+    for (int b = 0; b < bands.size(); b++) {
+        recordBytes += bands[b].needs.capacity() * sizeof(RowSpan);
+        largestKept = max(largestKept, keptBytes(bands[b], columnCount));
+        largestWindow = max(largestWindow, windowBytes(bands, bands[b], rowCount, columnCount));
+    }
+    long long keptLimit = budget - processBytes - recordBytes - largestWindow - largestKept - outputChunkBytes;
+    if (keptLimit < 0) {
+        cerr << "A memory budget of " << (budget >> 20) << " MB is too small for this sheet - evaluating it in bands needs about " << ((budget - keptLimit + (1 << 20) - 1) >> 20) << " MB" << endl;
+        return 1;
+    }
+
+    /* The last band (in evaluation order) to need each band - after it the band's values are thrown away */
+
+    vector<int> position(bands.size());
+    for (int p = 0; p < order.size(); p++) position[order[p]] = p;
+    for (int b = 0; b < bands.size(); b++) {
+        for (int k = graph.referenceStart[b]; k < graph.referenceStart[b + 1]; k++) {
+            RowBand& needed = bands[graph.references[k]];
+            needed.lastUse = max(needed.lastUse, position[b]);
+        }
+    }
+
+    /* The spill file is a new file of its own in the temporary directory (never one the user has), and it is removed however the run ends */
+
+    ofstream output(options.outputFileName, ios::binary);
+    if (!output) {
+        cerr << "Could not write " << options.outputFileName << endl;
+        return 1;
+    }
+    string spillFileName = temporaryFile("css");
+    fstream spill;
+    if (!spillFileName.empty()) spill.open(spillFileName, ios::in | ios::out | ios::binary | ios::trunc);
+    if (!spill.is_open()) {
+        cerr << "Could not create a temporary spill file" << endl;
+        if (!spillFileName.empty()) remove(spillFileName.c_str());
+        return 1;
+    }
+    long long spillEnd = 0, residentBytes = 0;
+    int nextOutput = 0, spilledBand = -1;
+    vector<Column> spilled;
+
+    for (int p = 0; p < order.size(); p++) {
+        RowBand& band = bands[order[p]];
+
+        /* The window is a sheet of the full size, but every column is sparse and only holds the band and the rows it needs, so it costs only as much as
+            they do. Range trees are not built for it - they are sized by the rows of the whole sheet - so range functions read their cells directly */
+
+        Sheet window = createSheet(rowCount, columnCount);
+        window.source = file;
+        loadNeededRows(window, bands, band, true, spill, spilledBand, spilled);
+
+        SpreadsheetData data;
+        data.file = file;
+        data.rowStart.push_back(0);
+        tokenizeRows(data, band.begin, band.end);
+        vector<int> formulaAbove(columnCount, -1);
+        for (int i = 0; i < band.rowCount; i++) {
+            for (long long k = data.rowStart[i]; k < data.rowStart[i + 1]; k++) {
+                const CellView& cell = data.cells[k];
+                int formulaCount = window.formulas.row.size();
+                setCellContents(window, band.firstRow + i, cell.column, file->data + cell.offset, cell.length);
+                if (window.formulas.row.size() > formulaCount) groupFilledFormula(window.formulas, formulaCount, formulaAbove);
+            }
+        }
+        loadNeededRows(window, bands, band, false, spill, spilledBand, spilled);
+
+        window.rangeIndex.leafCount = 1;
+        window.rangeIndex.treeOf.assign(columnCount, -1);
+        DependencyGraph windowGraph = buildDependencyGraph(window);
+        vector<char> windowCircular;
+        vector<int> windowOrder = topologicalOrder(windowGraph, windowCircular);
+        evaluateFormulas(window, windowGraph, windowOrder, windowCircular, options.threadCount);
+
+        if (band.lastUse > p) residentBytes += keepBandValues(window, band);
+
+        /* The rows are written straight away if every band above them has been written, otherwise they wait in the spill file */
+
+        RowIndex index = buildRowIndex(window, band.firstRow, band.firstRow + band.rowCount);
+        string buffer;
+        formatRows(window, index, band.firstRow, band.firstRow + band.rowCount, buffer);
+        if (order[p] == nextOutput) {
+            output.write(buffer.data(), buffer.size());
+            for (nextOutput++; nextOutput < bands.size() && bands[nextOutput].outputOffset >= 0; nextOutput++) copySpilledOutput(spill, bands[nextOutput], output);
+        }
+        else {
+            band.outputOffset = spillEnd;
+            band.outputLength = buffer.size();
+            spill.seekp(spillEnd);
+            spill.write(buffer.data(), buffer.size());
+            spillEnd += buffer.size();
+        }
+        releaseFileRange(*file, band.begin, band.end);
+
+        /* Bands nothing else needs are thrown away. If the rest still take more than keptLimit, the ones needed furthest ahead go to the spill file */
+
+        for (int b = 0; b < bands.size(); b++) {
+            if (!bands[b].resident) continue;
+            if (bands[b].lastUse <= p) {
+                residentBytes -= bands[b].residentBytes;
+                vector<Column>().swap(bands[b].values);
+                bands[b].resident = false;
+            }
+        }
+        while (residentBytes > keptLimit) {
+            int furthest = -1;
+            for (int b = 0; b < bands.size(); b++) {
+                if (bands[b].resident && (furthest < 0 || bands[b].lastUse > bands[furthest].lastUse)) furthest = b;
+            }
+            if (furthest < 0) break;
+            bands[furthest].spillOffset = spillBand(spill, spillEnd, bands[furthest].values);
+            residentBytes -= bands[furthest].residentBytes;
+            vector<Column>().swap(bands[furthest].values);
+            bands[furthest].resident = false;
+        }
+    }
+
+    output.close();
+    spill.close();
+    remove(spillFileName.c_str());
+    if (output.fail()) {
+        cerr << "Could not write " << options.outputFileName << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include "consolespreadsheet.h"
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+/*
+    Batch mode (--batch). Running the program once per file pays for starting a process every time, and leaves the processor idle while each file is read
+    and written. Instead a whole list of files goes through one process as a pipeline: loader threads map and tokenize the next files and read them into
+    sheets, worker threads evaluate the sheets that are ready, and a writer thread writes out the ones that are finished - so reading and writing the next
+    files overlaps with evaluating the current ones. Every file has the same output it would get on its own.
+
+    The stages are connected by queues that hold at most batchQueueLength sheets each. A stage that gets ahead of the next one waits for room, so no matter
+    how many files there are, only a few sheets are ever in memory at once.
+*/
+
+static bool isDirectory(const string& path) {
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat status;
+    return stat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode);
+#endif
+}
+
+static bool makeDirectory(const string& path) {
+    if (isDirectory(path)) return true;
+#ifdef _WIN32
+    return CreateDirectoryA(path.c_str(), NULL) != 0;
+#else
+    return mkdir(path.c_str(), 0777) == 0;
+#endif
+}
+
+bool listBatchInputs(const string& source, vector<string>& inputs) {
+
+    /* A directory stands for every file in it, and anything else is a list of file names, one per line. Files from a directory are taken in order of their
+        names, so a batch always runs the same way */
+
+    if (!isDirectory(source)) {
+        ifstream list(source);
+        if (!list) return false;
+        string line;
+        while (getline(list, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) inputs.push_back(line);
+        }
+        return true;
+    }
+
+    vector<string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA((source + "\\*").c_str(), &found);
+    if (search == INVALID_HANDLE_VALUE) return false;
+    do {
+        if ((found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) names.push_back(found.cFileName);
+    } while (FindNextFileA(search, &found));
+    FindClose(search);
+#else
+    DIR* directory = opendir(source.c_str());
+    if (directory == NULL) return false;
+    while (dirent* entry = readdir(directory)) {
+        string path = source + "/" + entry->d_name;
+        struct stat status;
+        if (stat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode)) names.push_back(entry->d_name);
+    }
+    closedir(directory);
+#endif
+
+    sort(names.begin(), names.end());
+    for (int i = 0; i < names.size(); i++) inputs.push_back(source + "/" + names[i]);
+    return true;
+}
+
+void pushBatchItem(BatchQueue& queue, BatchItem& item) {
+    unique_lock<mutex> guard(queue.lock);
+    queue.notFull.wait(guard, [&] { return queue.items.size() < batchQueueLength; });
+    queue.items.push_back(move(item));
+    queue.notEmpty.notify_one();
+}
+
+bool popBatchItem(BatchQueue& queue, BatchItem& item) {
+    unique_lock<mutex> guard(queue.lock);
+    queue.notEmpty.wait(guard, [&] { return !queue.items.empty() || queue.producers == 0; });
+    if (queue.items.empty()) return false;    // every producer is done and everything has been taken
+    item = move(queue.items.front());
+    queue.items.pop_front();
+    queue.notFull.notify_one();
+    return true;
+}
+
+void finishBatchProducer(BatchQueue& queue) {
+    lock_guard<mutex> guard(queue.lock);
+    if (--queue.producers == 0) queue.notEmpty.notify_all();
+}
+
+int runBatch(const Options& options) {
+    vector<string> inputs;
+    if (!listBatchInputs(options.inputFileName, inputs)) {
+        cerr << "Could not read the list of files " << options.inputFileName << endl;
+        return 1;
+    }
+
+    /* Every output is named after its input, inside the output directory. Two inputs with the same name (from different directories in a list) would
+        write over each other's output, so the batch is refused before anything is written */
+
+    vector<string> outputs(inputs.size());
+    vector<pair<string, int>> names;
+    for (int i = 0; i < inputs.size(); i++) {
+        size_t slash = inputs[i].find_last_of("/\\");
+        string name = slash == string::npos ? inputs[i] : inputs[i].substr(slash + 1);
+        outputs[i] = options.outputFileName + "/" + name;
+        names.push_back(make_pair(name, i));
+    }
+    sort(names.begin(), names.end());
+    for (int k = 1; k < names.size(); k++) {
+        if (names[k].first != names[k - 1].first) continue;
+        cerr << inputs[names[k - 1].second] << " and " << inputs[names[k].second] << " would both be written to " << outputs[names[k].second] << endl;
+        return 1;
+    }
+
+    if (!makeDirectory(options.outputFileName)) {
+        cerr << "Could not create the output directory " << options.outputFileName << endl;
+        return 1;
+    }
+
+    /* Reading is mostly waiting for the disk, so a quarter of the threads are enough to keep the workers busy. Each sheet is evaluated by a single thread -
+        with many files there is more to gain from evaluating several of them at once than from splitting up each one */
+
+    int loaderCount = max(1, options.threadCount / 4);
+    int workerCount = max(1, options.threadCount - loaderCount);
+
+    BatchQueue loaded, evaluated;
+    loaded.producers = loaderCount;
+    evaluated.producers = workerCount;
+    atomic<int> nextInput(0), failures(0);
+
+    auto loader = [&]() {
+        for (int i = nextInput++; i < inputs.size(); i = nextInput++) {
+            BatchItem item;
+            item.inputFileName = inputs[i];
+            item.outputFileName = outputs[i];
+
+            SpreadsheetData data = getDataFromSpreadsheet(item.inputFileName, 1);
+            if (!data.file) {
+                cerr << "Could not read " << item.inputFileName << endl;
+                failures++;
+                continue;
+            }
+            item.sheet = separateRows(data, 1);
+            pushBatchItem(loaded, item);
+        }
+        finishBatchProducer(loaded);
+    };
+
+    auto worker = [&]() {
+        BatchItem item;
+        while (popBatchItem(loaded, item)) {
+            convertFormulasToIntegers(item.sheet, 1);
+            pushBatchItem(evaluated, item);
+        }
+        finishBatchProducer(evaluated);
+    };
+
+    auto writer = [&]() {
+        BatchItem item;
+        while (popBatchItem(evaluated, item)) {
+            if (!outputToFile(item.sheet, item.outputFileName, 1)) {
+                cerr << "Could not write " << item.outputFileName << endl;
+                failures++;
+            }
+            item = BatchItem();    // lets go of the sheet (and its mapped input file) before waiting for the next one
+        }
+    };
+
+    vector<thread> threads;
+    for (int t = 0; t < loaderCount; t++) threads.push_back(thread(loader));
+    for (int t = 0; t < workerCount; t++) threads.push_back(thread(worker));
+    writer();
+    for (int t = 0; t < threads.size(); t++) threads[t].join();
+
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,246 @@
+#include "consolespreadsheet.h"
+#include <chrono>
+#include <random>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#include <cstdio>
+#include <cstdlib>
+
+/*
+    The benchmark (--benchmark) and the sheet generator it uses (--generate). The benchmark runs the same four phases as main - loading the file, reading its
+    cells into the sheet, evaluating the formulas and writing the output - several times over, timing each one, and prints the results as JSON so that they
+    can be kept and compared between versions. Without an input file it first generates one, so that sheets of any size and shape can be measured without
+    having to be written by hand.
+*/
+
+bool parseShape(const string& name, SheetShape& shape) {
+    const char* names[] = { "mixed", "chain", "fanin", "filldown", "cycles" };
+    for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (name == names[i]) {
+            shape = (SheetShape)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static string generateCell(const GeneratorOptions& generator, int row, int column, mt19937& random) {
+    int rowCount = generator.rowCount, columnCount = generator.columnCount;
+    string cell;
+
+    switch (generator.shape) {
+    case SHAPE_CHAIN:
+
+        /* Every cell adds 1 to the cell before it, reading the sheet row by row - a single chain through the whole sheet, as long as the sheet has cells */
+
+        if (row == 0 && column == 0) return "1";
+        if (column == 0) return "=" + cellName(row - 1, columnCount - 1) + "+1";
+        return "=" + cellName(row, column - 1) + "+1";
+
+    case SHAPE_FANIN:
+
+        /* Numbers everywhere, except that the last column adds up the rest of its row and the last row adds up everything above it with SUM */
+
+        if (row == rowCount - 1 && rowCount > 1) return "=SUM(" + cellName(0, column) + ":" + cellName(rowCount - 2, column) + ")";
+        if (column == columnCount - 1 && columnCount > 1) {
+            cell = "=" + cellName(row, 0);
+            for (int j = 1; j < column; j++) cell += "+" + cellName(row, j);
+            return cell;
+        }
+        return to_string(random() % 1000);
+
+    case SHAPE_FILLDOWN:
+
+        /* The first two columns are numbers and every column after them is the same formula on the two columns before it, filled down every row */
+
+        if (column < 2) return to_string(random() % 1000);
+        if (column % 2 == 0) return "=" + cellName(row, column - 2) + "+" + cellName(row, column - 1);
+        return "=" + cellName(row, column - 1) + "*2-" + cellName(row, column - 2);
+
+    default:
+
+        /* Half numbers and half formulas on two random cells from the rows above. For SHAPE_CYCLES every 100th row also points at the row below it, which
+            points back up, so the sheet is full of short cycles */
+
+        if (generator.shape == SHAPE_CYCLES && row % 100 == 0 && row + 1 < rowCount) return "=" + cellName(row + 1, column) + "+1";
+        if (generator.shape == SHAPE_CYCLES && row % 100 == 1) return "=" + cellName(row - 1, column) + "+1";
+        if (row == 0 || random() % 2 == 0) return to_string(random() % 1000);
+
+        cell = "=" + cellName(random() % row, random() % columnCount);
+        cell += ops[random() % 3];    // dividing by random cells would mostly give #NAN
+        cell += cellName(random() % row, random() % columnCount);
+        return cell;
+    }
+}
+
+bool generateSheet(const GeneratorOptions& generator, const string& fileName) {
+    ofstream output(fileName, ios::binary);
+    if (!output) return false;
+
+    /* The cells are generated in the order they are written, from a fixed seed, so the same options always give the same file. Empty cells are left out at
+        random to give the density asked for, but the first cell of every row is always kept so that no row is left out altogether */
+
+    mt19937 random(generator.seed);
+    string buffer;
+
+    for (int i = 0; i < generator.rowCount; i++) {
+        for (int j = 0; j < generator.columnCount; j++) {
+            string cell = generateCell(generator, i, j, random);
+            bool empty = j > 0 && random() % 100 >= generator.density;
+            if (!empty) buffer += cell;
+            if (j != generator.columnCount - 1) buffer.push_back(delimiter);
+        }
+        buffer.append(lineEnding);
+
+        if (buffer.size() >= outputChunkBytes) {
+            output.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    output.write(buffer.data(), buffer.size());
+    return (bool)output;
+}
+
+long long peakMemoryUsage() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss;    // already in bytes
+#else
+    return usage.ru_maxrss * 1024LL;
+#endif
+#endif
+}
+
+static string jsonString(const string& s) {
+
+    /* s as a JSON string - quotes, backslashes (as in every Windows path) and control characters have to be escaped */
+
+    string result = "\"";
+    for (int i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        }
+        else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            result += escape;
+        }
+        else result += c;
+    }
+    return result + "\"";
+}
+
+int runBenchmark(const Options& options) {
+
+    /* Without an input file the sheet is generated into a temporary file, and without an output file the output goes to one too (rather than output.txt,
+        which may well be the user's) - both are removed once the benchmark is done */
+
+    string inputFileName = options.inputFileName, outputFileName = options.outputFileName;
+    if (!options.inputFileGiven) {
+        inputFileName = temporaryFile("csb");
+        if (inputFileName.empty() || !generateSheet(options.generator, inputFileName)) {
+            cerr << "Could not write the generated sheet " << inputFileName << endl;
+            if (!inputFileName.empty()) remove(inputFileName.c_str());
+            return 1;
+        }
+    }
+    if (!options.outputFileGiven) {
+        outputFileName = temporaryFile("cso");
+        if (outputFileName.empty()) {
+            cerr << "Could not create a temporary file for the output" << endl;
+            if (!options.inputFileGiven) remove(inputFileName.c_str());
+            return 1;
+        }
+    }
+
+    /* Every repetition runs exactly what main does. The best time of each phase is the one least disturbed by anything else running on the machine, so that
+        is the one to compare - the mean is given as well */
+
+    vector<PhaseTimes> runs;
+    long long cellCount = 0, formulaCount = 0;
+    int rowCount = 0, columnCount = 0;
+    string failure;    // why the benchmark stopped early, if it did
+
+    for (int r = 0; r < options.repeatCount; r++) {
+        PhaseTimes times;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        SpreadsheetData data = getDataFromSpreadsheet(inputFileName, options.threadCount);
+        times.load = secondsSince(start);
+        if (!data.file) {
+            failure = "Could not read " + inputFileName;
+            break;
+        }
+
+        start = chrono::steady_clock::now();
+        Sheet sheet = separateRows(data, options.threadCount);
+        times.tokenize = secondsSince(start);
+
+        start = chrono::steady_clock::now();
+        convertFormulasToIntegers(sheet, options.threadCount);
+        times.evaluate = secondsSince(start);
+
+        start = chrono::steady_clock::now();
+        if (!outputToFile(sheet, outputFileName, options.threadCount)) {
+            failure = "Could not write " + outputFileName;
+            break;
+        }
+        times.write = secondsSince(start);
+
+        runs.push_back(times);
+        cellCount = data.cells.size();
+        formulaCount = sheet.formulas.row.size();
+        rowCount = sheet.rowCount;
+        columnCount = sheet.columnCount;
+    }
+    if (!options.inputFileGiven) remove(inputFileName.c_str());
+    if (!options.outputFileGiven) remove(outputFileName.c_str());
+    if (!failure.empty()) {
+        cerr << failure << endl;
+        return 1;
+    }
+
+    PhaseTimes best = runs[0], mean;
+    for (int r = 0; r < runs.size(); r++) {
+        best.load = min(best.load, runs[r].load);
+        best.tokenize = min(best.tokenize, runs[r].tokenize);
+        best.evaluate = min(best.evaluate, runs[r].evaluate);
+        best.write = min(best.write, runs[r].write);
+        mean.load += runs[r].load / runs.size();
+        mean.tokenize += runs[r].tokenize / runs.size();
+        mean.evaluate += runs[r].evaluate / runs.size();
+        mean.write += runs[r].write / runs.size();
+    }
+    double bestTotal = best.load + best.tokenize + best.evaluate + best.write;
+
+    const char* shapes[] = { "mixed", "chain", "fanin", "filldown", "cycles" };
+    cout.precision(6);
+    cout << fixed;
+    cout << "{" << endl;
+    if (options.inputFileGiven) cout << "  \"input\": " << jsonString(inputFileName) << "," << endl;
+    else cout << "  \"shape\": \"" << shapes[options.generator.shape] << "\", \"density\": " << options.generator.density << ", \"seed\": " << options.generator.seed << "," << endl;
+    cout << "  \"rows\": " << rowCount << ", \"columns\": " << columnCount << ", \"cells\": " << cellCount << ", \"formulas\": " << formulaCount << "," << endl;
+    cout << "  \"threads\": " << options.threadCount << ", \"repeats\": " << options.repeatCount << "," << endl;
+    cout << "  \"best\": { \"load\": " << best.load << ", \"tokenize\": " << best.tokenize << ", \"evaluate\": " << best.evaluate << ", \"write\": " << best.write << ", \"total\": " << bestTotal << " }," << endl;
+    cout << "  \"mean\": { \"load\": " << mean.load << ", \"tokenize\": " << mean.tokenize << ", \"evaluate\": " << mean.evaluate << ", \"write\": " << mean.write << " }," << endl;
+    cout << "  \"cellsPerSecond\": " << (bestTotal > 0 ? (long long)(cellCount / bestTotal) : 0) << "," << endl;
+    cout << "  \"peakMemoryBytes\": " << peakMemoryUsage() << endl;
+    cout << "}" << endl;
+    return 0;
+}
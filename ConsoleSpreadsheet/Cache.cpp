@@ -0,0 +1,109 @@
+#include "consolespreadsheet.h"
+#include <cstdio>
+
+/*
+    The result cache (--cache file). A sheet that is calculated again and again with only a few edits in between does not have to be evaluated from scratch
+    every time. The cache is a snapshot of the calculated sheet (see Snapshot.cpp) - its cells, compiled formulas, dependency graph and values - along with
+    the length and two unrelated 64 bit hashes of every row of the input it was calculated from. The next run hashes the rows of the input again and only
+    reads the rows where any of them changed back into the snapshot's live sheet, so recalculate evaluates just the formulas that depend on them (directly or
+    not), and everything else keeps its value. A changed row would have to keep its length and collide in both hashes at once to be missed.
+
+    The cache can never give a wrong answer, only a slower one: if it is missing, unreadable, from another version of the program or for a sheet of another
+    size, the input is simply calculated in full (and the cache written again). Every cell of a changed row is replaced, so nothing from an old row can be
+    left behind - and with so many rows changed that updating would cost more than starting over, it starts over too.
+*/
+
+static unsigned long long checkHash(const char* s, int length) {
+
+    /* A second hash for hashRows, unrelated to FNV-1a (hashText): every byte is added in and then multiplied and shifted, rather than xored in and
+        multiplied, so two rows colliding in one are no more likely to collide in the other */
+
+    unsigned long long hash = 0x243F6A8885A308D3ULL;
+    for (int i = 0; i < length; i++) {
+        hash = (hash + (unsigned char)s[i] + 1) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static vector<RowHash> hashRows(const LineIndex& lines) {
+    int rowCount = lines.rowOffset.size() - 1;
+    vector<RowHash> hashes(rowCount);
+    for (int i = 0; i < rowCount; i++) {
+
+        /* Only the contents count - the same row saved with Windows line endings is still the same row */
+
+        const char* row = lines.file->data + lines.rowOffset[i];
+        const char* rowEnd = lines.file->data + lines.rowOffset[i + 1];
+        if (rowEnd > row && rowEnd[-1] == '\n') rowEnd--;
+        if (rowEnd > row && rowEnd[-1] == '\r') rowEnd--;
+        hashes[i].length = rowEnd - row;
+        hashes[i].hash = hashText(row, rowEnd - row);
+        hashes[i].check = checkHash(row, rowEnd - row);
+    }
+    return hashes;
+}
+
+static bool sameRow(const RowHash& a, const RowHash& b) {
+    return a.length == b.length && a.hash == b.hash && a.check == b.check;
+}
+
+int runCached(const Options& options) {
+    LineIndex lines = indexLines(options.inputFileName);
+    int rowCount = lines.rowOffset.size() - 1, columnCount = lines.maxWidth;
+    vector<RowHash> hashes = hashRows(lines);
+
+    /* The cache can only be updated if it holds a sheet of the same size - otherwise every reference out of range would have compiled differently */
+
+    LiveSheet live;
+    vector<int> changedRows;
+    bool update = loadSnapshot(options.cacheFileName, live) && live.sheet.rowCount == rowCount && live.sheet.columnCount == columnCount && live.rowHashes.size() == rowCount;
+    if (update) {
+        for (int i = 0; i < rowCount; i++) {
+            if (!sameRow(hashes[i], live.rowHashes[i])) changedRows.push_back(i);
+        }
+        update = (long long)changedRows.size() * cacheRebuildShare <= rowCount;
+    }
+
+    if (update) {
+        live.threadCount = options.threadCount;
+        for (int r = 0; r < changedRows.size(); r++) {
+            int i = changedRows[r];
+            for (int j = 0; j < columnCount; j++) {
+                const char* s;
+                int length;
+                if (findCell(lines, i, j, s, length)) setCell(live, i, j, string(s, length));
+                else {
+                    int index = cellIndex(live.sheet.columns[j], i);
+                    if (index >= 0 && tagKind(live.sheet.columns[j].tags[index]) != CELL_EMPTY) setCell(live, i, j, "");
+                }
+            }
+        }
+        recalculate(live);
+    }
+    else {
+        SpreadsheetData data = getDataFromSpreadsheet(options.inputFileName, options.threadCount);
+        live = openLiveSheet(separateRows(data, options.threadCount), options.threadCount);
+    }
+    live.rowHashes = hashes;
+
+    if (!outputToFile(live.sheet, options.outputFileName, options.threadCount)) {
+        cerr << "Could not write " << options.outputFileName << endl;
+        return 1;
+    }
+    if (update && changedRows.empty()) return 0;    // the cache is already up to date
+
+    /* The new cache is written next to the old one and only then moved over it - the sheet may still be reading text out of the old one, which has to stay
+        in place until the sheet is gone (and a run cut short leaves the old cache as it was) */
+
+    string temporaryFileName = options.cacheFileName + ".tmp";
+    bool saved = saveSnapshot(live, temporaryFileName);
+    live = LiveSheet();
+    if (saved) remove(options.cacheFileName.c_str());    // rename will not replace a file everywhere
+    if (!saved || rename(temporaryFileName.c_str(), options.cacheFileName.c_str()) != 0) {
+        remove(temporaryFileName.c_str());
+        cerr << "Could not write the cache " << options.cacheFileName << endl;
+        return 1;
+    }
+    return 0;
+}
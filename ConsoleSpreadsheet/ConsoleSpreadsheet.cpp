@@ -2,6 +2,9 @@
 #include <fstream> 
 #include <string> 
 #include <vector>     // Primary tool to store data from spreadsheet
+#include <cstring>
+#include <thread>
+#include <functional>
 #include "consolespreadsheet.h"
 
 /*
@@ -12,528 +15,663 @@
     contents of cell B2. If any cell identifier references an invalid cell (either an empty cell or a cell that is out of range of the spreadsheet), it will replace
     that cell with #NAN (not a number). If there is a cell that references itself (either directly or through other cells), it will be replaced with #ERROR.
     Following that, any cell that attempts to reference a cell with #NAN or #ERROR will be replaced with those messages respectively (where #NAN takes precidence).
+    A formula can also use the functions SUM, MIN, MAX and COUNT over a rectangle of cells (so =SUM(A1:A100)*2 or =MAX(A1:C10)-MIN(A1:C10)), which skip empty
+    and text cells - MIN and MAX of a range without any numbers give #NAN, and any #NAN or #ERROR inside the range is passed on like a single reference.
     The spreadsheet with all integer values and #NAN or #ERROR messages will then be output to the desired text file (set to a default value of output.txt).
 
 */
 
-int main() {
+int main(int argc, char* argv[]) {
 
-    string inputFileName = "spreadsheet.txt";
-    string outputFileName = "output.txt";
+    Options options;
+    if (!parseOptions(argc, argv, options)) return 1;
 
+    /* Generating a sheet and running the benchmark are done by themselves (see Benchmark.cpp), as are batches (Batch.cpp) and the analysis (Analysis.cpp) */
 
-    /* Parses the input file and scans line by line, adding each line to a vector as a string */
-    vector<string> rows = getDataFromSpreadsheet(inputFileName);
-
-    /* At this point, each element in the vector rows is just a single string containing the entire line. This line needs to be separated into its cells */
+    if (options.command == COMMAND_GENERATE) {
+        if (!generateSheet(options.generator, options.outputFileName)) {
+            cerr << "Could not write the generated sheet " << options.outputFileName << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (options.command == COMMAND_BENCHMARK) return runBenchmark(options);
+    if (options.command == COMMAND_BATCH) return runBatch(options);
+    if (options.command == COMMAND_ANALYZE) return runAnalysis(options);
 
-    vector<vector<string>> sheet = separateRows(rows);
+    /* Asking for a few cells only evaluates what they depend on (see Query.cpp), and prints them instead of writing an output file. The same cells can be
+        asked for in a list of what-if scenarios over the sheet (see Scenario.cpp) */
 
-    /* Now, the vector of vectors sheet contains the entire spreadsheet properly indexed - sheet[0][0] contains all data within cell 1 (row 1 column 1) as a single string
-       Additionally, the way spreadsheet.txt may have been formatted would leave some rows longer than others. separateRows fills in space at the end of a row with tab stops (delimiter)
-       so that each row is the same size (makes it much easier to find if a call to sheet is within range or not */
+    if (options.command == COMMAND_SCENARIOS) return runScenarios(options);
 
-    convertFormulasToIntegers(sheet);
+    if (options.command == COMMAND_QUERY) {
+        vector<string> values = queryCells(options.inputFileName, options.queryCells, options.threadCount);
+        for (int k = 0; k < values.size(); k++) cout << cellName(options.queryCells[k].row, options.queryCells[k].column) << delimiter << values[k] << endl;
+        return 0;
+    }
 
-    /* The sheet now contains only integer values in place of formulas, with #NAN and #ERROR properly placed if a reference to an empty or out of range cell was called (#NAN) or
-        there was a self reference (#ERROR)*/
+    /* A workbook loads the other sheets its first sheet references along with it (see Workbook.cpp) */
 
-    outputToFile(sheet, outputFileName);
+    if (options.command == COMMAND_RUN && options.workbook) return runWorkbook(options);
 
-    /* The new sheet with all integer values is now in output.txt */
+    /* A sheet that may not fit in memory is evaluated a band of rows at a time (see Banded.cpp) */
 
-    return 0;
-}
+    if (options.command == COMMAND_RUN && options.memoryBudget > 0) return runBanded(options);
 
-vector<string> getDataFromSpreadsheet(const string& fileName) {
-    ifstream file;
-    file.open(fileName);
+    /* With a result cache, only what changed since the last run is evaluated again (see Cache.cpp) */
 
-    /* Opens the input file stream to be able to read input.txt */
+    if (options.command == COMMAND_RUN && !options.cacheFileName.empty()) return runCached(options);
 
-    vector<string> rows;
-    string row;
-    while (getline(file, row)) {
-        rows.push_back(row);
+    /* A snapshot (see Snapshot.cpp) already holds the calculated sheet, so there is nothing left to do but write it out */
 
-        /* Adds each row into the vector rows */
+    if (options.command == COMMAND_EXPORT || (options.command == COMMAND_RUN && isSnapshotFile(options.inputFileName))) {
+        LiveSheet live;
+        if (!loadSnapshot(options.inputFileName, live)) {
+            cerr << "Could not read the snapshot " << options.inputFileName << endl;
+            return 1;
+        }
+        if (!outputToFile(live.sheet, options.outputFileName, options.threadCount)) {
+            cerr << "Could not write " << options.outputFileName << endl;
+            return 1;
+        }
+        return 0;
     }
 
-    file.close();
-
-    return rows;
-}
+    /* With --stats every phase is timed (see Stats.cpp) */
 
-vector<vector<string>> separateRows(const vector<string>& rows) {
-    vector<vector<string>> separatedRows;
-    int maxSize = 0;
+    statisticsEnabled = options.stats;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
 
-    /*maxSize is needed for the purpose of filling in empty cells at the end of a row so that the spreadsheet is a perfect rectangle - each column has the same amount of rows*/
+    /* Maps the input file into memory and scans it once, finding where every row and every cell begins and ends */
+    SpreadsheetData data = getDataFromSpreadsheet(options.inputFileName, options.threadCount);
+    statistics.phases.load = secondsSince(start);
 
-    for (register int i = 0; i < rows.size(); i++) {
-        string row = rows[i];
-        vector<string> tokens = separateRowIntoCells(row);
+    /* At this point, data only knows where each cell is within the file. The cells need to be read into the sheet */
 
-        /* On any given iteration of this for loop, tokens now contains every cell within a row, separated by cell */
+    start = chrono::steady_clock::now();
+    Sheet sheet = separateRows(data, options.threadCount);
+    statistics.phases.tokenize = secondsSince(start);
 
-        if (tokens.size() > maxSize) maxSize = tokens.size();
+    /* To make a snapshot, the sheet is calculated exactly as for the output, and saved along with everything that was worked out on the way */
 
-        separatedRows.push_back(tokens);
+    if (options.command == COMMAND_IMPORT) {
+        LiveSheet live = openLiveSheet(move(sheet), options.threadCount);
+        if (!saveSnapshot(live, options.outputFileName)) {
+            cerr << "Could not write the snapshot " << options.outputFileName << endl;
+            return 1;
+        }
+        return 0;
     }
 
-    /*After the loop, separatedRows contains all cells that were present in input.txt */
+    /* Now, sheet contains the entire spreadsheet properly indexed - sheet.columns[0] holds the first column, and every cell is already stored as an integer, a text value
+       or a compiled formula. Additionally, the way spreadsheet.txt may have been formatted would leave some rows longer than others. The sheet is as wide as the longest row,
+       with the cells at the end of shorter rows left empty (makes it much easier to find if a call to sheet is within range or not */
+
+    start = chrono::steady_clock::now();
+    convertFormulasToIntegers(sheet, options.threadCount);
+    statistics.phases.evaluate = secondsSince(start);
 
-    for (int i = 0; i < separatedRows.size(); i++) {
-        while (separatedRows[i].size() < maxSize) separatedRows[i].push_back("\t");
+    /* The sheet now contains only integer values in place of formulas, with #NAN and #ERROR properly placed if a reference to an empty or out of range cell was called (#NAN) or
+        there was a self reference (#ERROR)*/
+
+    start = chrono::steady_clock::now();
+    if (!outputToFile(sheet, options.outputFileName, options.threadCount)) {
+        cerr << "Could not write " << options.outputFileName << endl;
+        return 1;
     }
+    statistics.phases.write = secondsSince(start);
 
-    /*Properly formatted separatedRows, each column has equal rows */
+    /* The new sheet with all integer values is now in output.txt */
 
-    return separatedRows;
+    if (options.stats) printStatistics(sheet, options.topCount);
+    return 0;
 }
 
-vector<string> separateRowIntoCells(const string& s) {
-    vector<string> cells;
+bool parseOptions(int argc, char* argv[], Options& options) {
+
+    /* By default every core is used. The input and output files can be given after the options, otherwise spreadsheet.txt and output.txt are used.
+        --import turns the input file into a snapshot (the output file), and --export writes a snapshot back out as text. A snapshot given as the input
+        without either is simply written out too. --generate writes a generated sheet to the one file given, and --benchmark times the program on the input
+        file, or on a generated sheet if there is no input file. --stats prints what the calculation did and how long it took as JSON, along with the --top
+        (10 by default) cells that took longest to evaluate. --memory-budget evaluates a sheet too large for memory a band of rows at a time, using about
+        that many megabytes. --batch calculates every file in the input directory (or listed in the input file) into the output directory. --cells only
+        calculates the cells listed (like C3,D10) and prints their values. --analyze prints the shape of the sheet's dependency graph (and --graph writes
+        the graph itself to a file). --cache keeps the results in a file, so the next run only evaluates what has changed. --scenarios prints the --cells
+        in every what-if scenario listed in a file. --workbook lets the input reference the sheets in the files next to it, like Sheet2!B7. */
+
+    options.threadCount = thread::hardware_concurrency();
+    if (options.threadCount < 1) options.threadCount = 1;
 
-    /*Format for the rows can be a little tricky - something like 3\t4\t5 will be {3, 4, 5}, but \t3\t4\t\t5 will be {\t, 3, 4, \t, 5} */
+    int fileCount = 0;
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
 
-    if (containsDelimiter(s)) {
-        if (s[0] == delimiter) {
-            /* If the first character is the delimeter, add an empty cell to cells. */
-            cells.push_back(string(1, delimiter));
-            vector<string> nextTokens = separateRowIntoCells(s.substr(1, s.length() - 1)); // tokenizes the rest of the string
-            cells.insert(cells.end(), nextTokens.begin(), nextTokens.end());   // appends the next tokens to vector<string> tokens
+        if (argument == "--threads" && i + 1 < argc) {
+            options.threadCount = atoi(argv[++i]);
+            if (options.threadCount < 1) options.threadCount = 1;
+        }
+        else if (argument == "--import" && options.command == COMMAND_RUN) options.command = COMMAND_IMPORT;
+        else if (argument == "--export" && options.command == COMMAND_RUN) options.command = COMMAND_EXPORT;
+        else if (argument == "--generate" && options.command == COMMAND_RUN) options.command = COMMAND_GENERATE;
+        else if (argument == "--benchmark" && options.command == COMMAND_RUN) options.command = COMMAND_BENCHMARK;
+        else if (argument == "--batch" && options.command == COMMAND_RUN) options.command = COMMAND_BATCH;
+        else if (argument == "--analyze" && options.command == COMMAND_RUN) options.command = COMMAND_ANALYZE;
+        else if (argument == "--graph" && i + 1 < argc) options.graphFileName = argv[++i];
+        else if (argument == "--cache" && i + 1 < argc) options.cacheFileName = argv[++i];
+        else if (argument == "--scenarios" && i + 1 < argc) options.scenarioFileName = argv[++i];
+        else if (argument == "--workbook") options.workbook = true;
+        else if (argument == "--cells" && i + 1 < argc && options.command == COMMAND_RUN && parseCellList(argv[i + 1], options.queryCells)) {
+            options.command = COMMAND_QUERY;
+            i++;
+        }
+        else if (argument == "--rows" && i + 1 < argc) options.generator.rowCount = max(1, atoi(argv[++i]));
+        else if (argument == "--columns" && i + 1 < argc) options.generator.columnCount = max(1, atoi(argv[++i]));
+        else if (argument == "--density" && i + 1 < argc) options.generator.density = min(100, max(0, atoi(argv[++i])));
+        else if (argument == "--seed" && i + 1 < argc) options.generator.seed = (unsigned)atoi(argv[++i]);
+        else if (argument == "--repeat" && i + 1 < argc) options.repeatCount = max(1, atoi(argv[++i]));
+        else if (argument == "--memory-budget" && i + 1 < argc) options.memoryBudget = max(1LL, atoll(argv[++i])) << 20;
+        else if (argument == "--stats") options.stats = true;
+        else if (argument == "--top" && i + 1 < argc) options.topCount = max(0, atoi(argv[++i]));
+        else if (argument == "--shape" && i + 1 < argc && parseShape(argv[i + 1], options.generator.shape)) i++;
+        else if (argument.length() > 0 && argument[0] != '-' && fileCount < 2) {
+            if (fileCount++ == 0) options.inputFileName = argument;
+            else options.outputFileName = argument;
         }
         else {
-            string cell;
-            for (int i = 0; s[i] != delimiter; i++) {
-                cell += s[i];
-            }
-            cells.push_back(cell);
-            vector<string> nextTokens = separateRowIntoCells(s.substr(cell.length() + 1, s.length() - cell.length()));
-            cells.insert(cells.end(), nextTokens.begin(), nextTokens.end());
-
-            /* If the first character is not a delimiter, will not be an empty cell. Iterate through the row until a delimiter is reached, add that string to a new cell
-                and continue separating the row (not including that next delimiter) */
+            cerr << "Usage: ConsoleSpreadsheet [--threads N] [--stats [--top N]] [--workbook] [input file] [output file]" << endl;
+            cerr << "       ConsoleSpreadsheet [--threads N] (--memory-budget MB | --cache file) [input file] [output file]" << endl;
+            cerr << "       ConsoleSpreadsheet (--import | --export) [--threads N] input file output file" << endl;
+            cerr << "       ConsoleSpreadsheet --generate [--shape mixed|chain|fanin|filldown|cycles] [--rows N] [--columns N] [--density P] [--seed N] file" << endl;
+            cerr << "       ConsoleSpreadsheet --cells C3,D10 [--threads N] [--scenarios file] [input file]" << endl;
+            cerr << "       ConsoleSpreadsheet --analyze [--top N] [--graph file.dot | file.json] [input file]" << endl;
+            cerr << "       ConsoleSpreadsheet --batch [--threads N] (input directory | file listing the inputs) output directory" << endl;
+            cerr << "       ConsoleSpreadsheet --benchmark [--threads N] [--repeat N] [generator options] [input file] [output file]" << endl;
+            return false;
         }
-
     }
+    options.inputFileGiven = fileCount > 0;
+    options.outputFileGiven = fileCount > 1;
 
-    /* If there are no more delimiters left in the row, can just add the remaining string to the cells. */
-
-    else if (s.length() != 0) {
-        cells.push_back(s);
+    if ((options.command == COMMAND_IMPORT || options.command == COMMAND_EXPORT || options.command == COMMAND_BATCH) && fileCount < 2) {
+        cerr << "--import, --export and --batch need both an input and an output" << endl;
+        return false;
     }
-
-    return cells;
-}
-
-void convertFormulasToIntegers(vector<vector<string>>& sheet) {
-    for (int i = 0; i < sheet.size(); i++) {
-        for (int j = 0; j < sheet[i].size(); j++) {
-            if (sheet[i][j][0] == '=') {
-
-                /* Idenifies if the value within the cell was a formula (began with a '=') or just an integer. If it was an integer, it can remain unchanged. However, if it was a formula,
-                * convertFormula must evaluate the formula to an integer. */
-
-                string convertedFormula = convertFormula(sheet, sheet[i][j], i, j);
-                sheet[i][j] = convertedFormula;
-            }
+    if (!options.scenarioFileName.empty()) {
+        if (options.command != COMMAND_QUERY) {
+            cerr << "--scenarios needs the cells to calculate in each scenario (--cells)" << endl;
+            return false;
         }
+        options.command = COMMAND_SCENARIOS;
     }
-}
-
-string convertFormula(const vector<vector<string>>& sheet, string s, const int& currentRow, const int& currentCol) {
-
-    /* Takes the formula and formats it properly - "A3    + B1" is now "A3+B1" */
-    removeSpaces(s);
-
-    vector<string> cellIdentifiers = getIdentifiers(s);
-    vector<char> operators = getOperators(s);
 
-    /* Important: going forward, a cell identifier is a value in the form A1 (string integer) that references a specific cell. Operators are simply all of the
-        mathematical operators used in calculations. So, cellIdentifiers and operators contain the ordered list of all of the identifiers and operators used in any given formula.
-
-        Example: "=A3+B1*C3
-        cellIdentifiers = {A3, B1, C3}
-        operators = {'+', '*'}
-
-        */
-
-
-        /*Check if all of the identifiers in the vector<string> point to valid cells (nonempty, within range). If an identifier points to an invalid cell, that entire formula will be replaced
-        with "#NAN" */
-
-    if (!validIdentifiers(cellIdentifiers, sheet)) return "#NAN";
-
-    /* Similarly, check if cells circularly reference themselves. To avoid an infinite loop, replace the formula with "#ERROR" */
-
-    if (!isNumber(s)) { // An integer value cannot be self referencial, do not need to check this case.
-        if (circularReference(cellIdentifiers, sheet, currentRow, currentCol)) return "#ERROR";
+    /* --workbook, --memory-budget and --cache are each a different way of calculating a text file into a text file, so only one of them can be used, and
+        none with a snapshot or any other command. --stats only times the calculation done by a plain run or a workbook - a banded or cached run never holds
+        the whole sheet it would describe */
 
+    int modeCount = (options.workbook ? 1 : 0) + (options.memoryBudget > 0 ? 1 : 0) + (options.cacheFileName.empty() ? 0 : 1);
+    bool snapshotInput = options.command == COMMAND_RUN && isSnapshotFile(options.inputFileName);
+    if (modeCount > 1) {
+        cerr << "Only one of --workbook, --memory-budget and --cache can be used at a time" << endl;
+        return false;
     }
-
-    /*Base case for recursive function - if cellIdentifiers only contains one value (either an integer or a single reference to another cell. */
-
-    if (cellIdentifiers.size() == 1) {
-        int row = getRow(cellIdentifiers[0]);
-        int col = getColumn(cellIdentifiers[0]);
-
-        if (sheet[row][col][0] == '=') {
-            return convertFormula(sheet, sheet[row][col], row, col);
+    if (modeCount > 0 && (options.command != COMMAND_RUN || snapshotInput)) {
+        cerr << "--workbook, --memory-budget and --cache only calculate a text file into a text file" << endl;
+        return false;
+    }
+    if (options.stats && (options.command != COMMAND_RUN || snapshotInput || options.memoryBudget > 0 || !options.cacheFileName.empty())) {
+        cerr << "--stats only works when calculating a text file, with or without --workbook" << endl;
+        return false;
+    }
+    if (options.command == COMMAND_GENERATE) {
+        if (fileCount != 1) {
+            cerr << "--generate needs the file to write the sheet to" << endl;
+            return false;
         }
-
-        /* If the cell contains a simple formula (=A1), exits the function with the value at the referenced cell. Otherwise, simply returns the integer value at the cell. */
-
-        return sheet[row][col];
+        options.outputFileName = options.inputFileName;
     }
 
-    /* For any given formula, only two operations can be done at the same time. So, this function must be recursively called, performing one operation each time */
-
-    while (cellIdentifiers.size() > 1) {
-
-        /* If there is a multiplication or division operator in the formula, do those first */
-
-        int i = indexOfMultDiv(operators);
-        if (i >= 0) {
-            string firstCell = cellIdentifiers[i];
-            string secondCell = cellIdentifiers[i + 1];
-
-            /* cellIdentifiers[i] and [i+1] refer to the cell identifiers that must be multiplied or divided. Because i is the index of the '*' or '/' sign in the operators vector,
-                must either multiply or divide the correct elements by one another*/
-
-            if (!isNumber(firstCell)) {
-
-                int column = getColumn(firstCell);
-                int row = getRow(firstCell);
-                firstCell = sheet[row][column];
-
-                if (firstCell[0] == '=') firstCell = convertFormula(sheet, firstCell, row, column);
-
-                /* firstCell references another cell. If that new cell is itself a formula, that cell must be converted into an integer before it can be used. However, if it is an integer,
-                firstCell can be replaced by that integer. */
-
-            }
-
-            if (!isNumber(secondCell)) {
-                int column = getColumn(secondCell);
-                int row = getRow(secondCell);
-                secondCell = sheet[row][column];
-
-
-                if (secondCell[0] == '=') secondCell = convertFormula(sheet, secondCell, row, column);
-
-                /*Same case applies to secondCell - if the new cell references a formula, it must be converted before it can be used in an operation */
-            }
-
-            if (firstCell == "#ERROR" || secondCell == "#ERROR") return "#ERROR";
-
-            /* Special case - if a cell references a cell that is self referential on itself, it must stop the operation and replace the formula with "#ERROR" */
+    return true;
+}
 
-            string value = performOperation(firstCell, secondCell, operators[i]);
+static void forEachChunk(int chunkCount, int threadCount, const function<void(int)>& work) {
 
-            /* Performs either multiplication or division on the two cells */
+    /* Runs work(0) .. work(chunkCount - 1) on up to threadCount threads, each taking the next chunk as soon as it is done with the last one */
 
-            cellIdentifiers[i] = value;
-            cellIdentifiers.erase(cellIdentifiers.begin() + i + 1);
-            operators.erase(operators.begin() + i);
+    atomic<int> nextChunk(0);
+    auto worker = [&]() {
+        for (int c = nextChunk++; c < chunkCount; c = nextChunk++) work(c);
+    };
+    vector<thread> workers;
+    for (int t = 1; t < min(threadCount, chunkCount); t++) workers.push_back(thread(worker));
+    worker();
+    for (int t = 0; t < workers.size(); t++) workers[t].join();
+}
 
-            /*cellIdentifiers updates having done exactly one multiplication or division operation between two values. One of the old values is then removed
-            * from the vector to shrink its size. Also, the operation just used must be removed from the operators vector */
+SpreadsheetData getDataFromSpreadsheet(const string& fileName, int threadCount) {
+    SpreadsheetData data;
+    data.rowStart.push_back(0);
+
+    /* Maps the input file into memory rather than reading it line by line - the cells are then read straight out of the file's pages, and none of them
+        are ever copied into a string of their own */
+
+    data.file = mapFile(fileName);
+    if (!data.file || data.file->size == 0) return data;
+
+    /* A large file is cut into one chunk per thread (but none smaller than loadChunkBytes), each ending at the end of the first row to reach its size. Every
+        chunk is tokenized by its own thread into a SpreadsheetData of its own, and those are then joined back together in order - the offsets of the cells
+        are already offsets into the whole file, so only rowStart has to be moved along */
+
+    const char* text = data.file->data;
+    long long size = data.file->size;
+    long long chunkBytes = max(loadChunkBytes, (size + max(threadCount, 1) - 1) / max(threadCount, 1));
+    vector<long long> bounds(1, 0);
+    while (bounds.back() < size) {
+        long long end = min(size, bounds.back() + chunkBytes);
+        if (end < size) {
+            const char* newline = (const char*)memchr(text + end - 1, '\n', size - end + 1);
+            end = newline == NULL ? size : newline - text + 1;
         }
-        else {
-
-            /*This is the case in which there are neither multiplication or division operations to be done on any of the cells. Because it is just addition and subtraction,
-            the order does not matter and we can simply go from left to right */
+        bounds.push_back(end);
+    }
 
-            string firstCell = cellIdentifiers[0];
-            string secondCell = cellIdentifiers[1];
+    int chunkCount = bounds.size() - 1;
+    if (chunkCount == 1) {
+        tokenizeRows(data, 0, size);
+        return data;
+    }
 
-            if (!isNumber(firstCell)) {
-                int column = getColumn(firstCell);
-                int row = getRow(firstCell);
-                firstCell = sheet[row][column];
+    vector<SpreadsheetData> parts(chunkCount);
+    forEachChunk(chunkCount, threadCount, [&](int c) {
+        parts[c].file = data.file;
+        parts[c].rowStart.push_back(0);
+        tokenizeRows(parts[c], bounds[c], bounds[c + 1]);
+    });
+
+    vector<long long> cellBase(chunkCount + 1, 0);
+    vector<int> rowBase(chunkCount + 1, 0);
+    for (int c = 0; c < chunkCount; c++) {
+        cellBase[c + 1] = cellBase[c] + parts[c].cells.size();
+        rowBase[c + 1] = rowBase[c] + parts[c].rowStart.size() - 1;
+        data.maxWidth = max(data.maxWidth, parts[c].maxWidth);
+    }
+    data.cells.resize(cellBase[chunkCount]);
+    data.rowStart.resize(rowBase[chunkCount] + 1);
+    data.chunks.resize(chunkCount);
+
+    forEachChunk(chunkCount, threadCount, [&](int c) {
+        SpreadsheetData& part = parts[c];
+        copy(part.cells.begin(), part.cells.end(), data.cells.begin() + cellBase[c]);
+        for (int i = 1; i < part.rowStart.size(); i++) data.rowStart[rowBase[c] + i] = part.rowStart[i] + cellBase[c];
+        data.chunks[c] = move(part.chunks[0]);
+        data.chunks[c].firstRow = rowBase[c];
+        part = SpreadsheetData();
+    });
+
+    return data;
+}
 
-                if (firstCell[0] == '=') firstCell = convertFormula(sheet, firstCell, row, column);
+void tokenizeRows(SpreadsheetData& data, long long begin, long long end) {
+    const char* text = data.file->data;
+
+    data.chunks.push_back(TokenChunk());
+    TokenChunk& chunk = data.chunks.back();
+    chunk.firstRow = data.rowStart.size() - 1;
+
+    /* Format for the rows can be a little tricky - something like 3\t4\t5 will be {3, 4, 5}, but \t3\t4\t\t5 will be {\t, 3, 4, \t, 5}. Every delimiter ends
+        a cell (which is empty if there was nothing before it), and whatever is left after the last delimiter is one more cell - unless there is nothing left.
+        So 1\t2\t is only two cells wide, while 1\t2\t\t is three. */
+
+    const char* row = text + begin;
+    while (row < text + end) {
+        const char* rowEnd = (const char*)memchr(row, '\n', text + end - row);
+        if (rowEnd == NULL) rowEnd = text + end;
+
+        const char* next = rowEnd + 1;
+        if (rowEnd > row && rowEnd[-1] == '\r') rowEnd--;    // a file saved with Windows line endings
+
+        int column = 0;
+        const char* cell = row;
+        while (true) {
+            const char* cellEnd = (const char*)memchr(cell, delimiter, rowEnd - cell);
+            bool last = cellEnd == NULL;
+            if (last) cellEnd = rowEnd;
+
+            /* Only cells with something in them are recorded - the empty ones are just the gaps between the columns that were recorded. Each one is also
+                counted for its column, so separateRows knows how much room every column needs without looking at the cells again */
+
+            if (cellEnd > cell) {
+                data.cells.push_back({ cell - text, (int)(cellEnd - cell), column });
+                if (column >= chunk.filled.size()) {
+                    chunk.filled.resize(column + 1, 0);
+                    chunk.formulas.resize(column + 1, 0);
+                }
+                chunk.filled[column]++;
+                if (cell[0] == '=') chunk.formulas[column]++;
             }
-
-            if (!isNumber(secondCell)) {
-                int column = getColumn(secondCell);
-                int row = getRow(secondCell);
-                secondCell = sheet[row][column];
-
-                if (secondCell[0] == '=') secondCell = convertFormula(sheet, secondCell, row, column);
+            if (last) {
+                if (cellEnd > cell) column++;
+                break;
             }
+            column++;
+            cell = cellEnd + 1;
+        }
 
-            if (firstCell == "#ERROR" || secondCell == "#ERROR") return "#ERROR";
-
-            string value = performOperation(firstCell, secondCell, operators[0]);
-
-            cellIdentifiers[0] = value;
-            cellIdentifiers.erase(cellIdentifiers.begin() + 1);
-            operators.erase(operators.begin());
+        if (column > data.maxWidth) data.maxWidth = column;
+        data.rowStart.push_back(data.cells.size());
 
-            /*Because the operations are performed from left to right, operators simply looses its leftmost operator. Additionally, cellIdentifiers[0] gets replaced with
-            the new correct value (either cellIdentifiers[0] + cellIdentifiers[1] or cellIdentifiers[0] - cellIdentifiers[1]. So, cellIdentifiers[1] can be removed. */
-        }
+        row = next;
     }
 
-    /* Once this point is reached, there is only one value remaining in cellIdentifiers - a single integer value that represents the original formula.
-        Because there is only one identifier remaining, we can return cellIdentifiers[0]. */
-
-    return cellIdentifiers[0];
+    chunk.rowCount = data.rowStart.size() - 1 - chunk.firstRow;
 }
 
-vector<string> getIdentifiers(const string& s) {
-    vector<string> cellIdentifiers;
-
-    /* Makes sure that s does in fact contain identifiers. */
-    if (containsIdentifier(s)) {
-
-        /* Checks if the first character in s is wither an operator or an equals sign (signifying it to be a formula). In this case, it will recursively call itself,
-            adding the rest of the operators to cellIdentifiers. */
-
-        if (isOperator(s[0]) || s[0] == '=') {
-            vector<string> nextIdentifiers = getIdentifiers(s.substr(1, s.length() - 1));
-            cellIdentifiers.insert(cellIdentifiers.end(), nextIdentifiers.begin(), nextIdentifiers.end());
+Sheet separateRows(const SpreadsheetData& data, int threadCount) {
+
+    /* Now that the size of the spreadsheet is known, every cell is moved into the typed sheet. Numbers are converted to integers here, once, and formulas are
+       compiled - nothing later on has to look at the text again. Empty cells and the space past the end of a shorter row are simply left empty. The sheet
+       keeps the mapped file alive, so text cells can keep pointing into it. */
+
+    Sheet sheet = createSheet(data.rowStart.size() - 1, data.maxWidth);
+    sheet.source = data.file;
+    int chunkCount = data.chunks.size();
+
+    /* Each column is stored sparsely (only its filled cells) unless at least a quarter of its rows are filled in. A mostly filled column is cheaper to keep
+        dense, with every row in place, and a mostly empty one is cheaper to keep sparse - so memory follows the number of filled cells, not rows x columns.
+        The tokenizer already counted the cells of every column in each chunk. */
+
+    vector<long long> filled(sheet.columnCount, 0), formulas(sheet.columnCount, 0);
+    vector<vector<long long>> slotBase(chunkCount, vector<long long>(sheet.columnCount, 0));
+    vector<int> formulaBase(chunkCount + 1, 0);
+    for (int c = 0; c < chunkCount; c++) {
+        const TokenChunk& chunk = data.chunks[c];
+        formulaBase[c + 1] = formulaBase[c];
+        for (int j = 0; j < chunk.filled.size(); j++) {
+            slotBase[c][j] = filled[j];
+            filled[j] += chunk.filled[j];
+            formulas[j] += chunk.formulas[j];
+            formulaBase[c + 1] += chunk.formulas[j];
         }
+        for (int j = chunk.filled.size(); j < sheet.columnCount; j++) slotBase[c][j] = filled[j];
+    }
 
-        /* If the first character is not an operator or an equals sign, that means it is a valid cell identifier (either an integer value or a reference to another cell) */
+    /* Every array is given exactly the room it is going to need before any cell is stored, so none of them ever has to grow (and copy everything in it) -
+        loading a sheet allocates a few arrays per column, however many cells there are. Since every chunk knows where its cells go in each column, the
+        chunks can then all be read into the sheet at the same time */
 
+    for (int j = 0; j < sheet.columnCount; j++) {
+        Column& cells = sheet.columns[j];
+        if (filled[j] * denseColumnFill >= sheet.rowCount) makeColumnDense(sheet, j);
         else {
-            string identifier;
-            for (int i = 0; !isOperator(s[i]) && i < s.length(); i++) {
-                identifier += s[i];
-            }
-
-            /*Identifier concatinates the next character with itself until it reaches either the end of the string or an operator, in which case the loop terminates.
-                By the end, identifier will either be an integer or a valid reference to another cell (string integer) */
+            cells.rows.resize(filled[j]);
+            cells.tags.resize(filled[j]);
+            cells.values.resize(filled[j], 0);
+        }
+        if (formulas[j] > 0) cells.formulas.assign(cells.sparse ? filled[j] : sheet.rowCount, -1);
+    }
 
-            cellIdentifiers.push_back(identifier);
+    /* Each thread compiles the formulas of its chunk into a CompiledFormulas of its own (formulas filled down a column are grouped as they go, see
+        FormulaGroups.cpp - a group that runs across the border of two chunks is simply split in two). Text cells are only noted down, because they all share
+        one table of interned text */
+
+    vector<CompiledFormulas> programs(chunkCount);
+    vector<vector<PendingText>> texts(chunkCount);
+    forEachChunk(chunkCount, threadCount, [&](int c) {
+        const TokenChunk& chunk = data.chunks[c];
+        CompiledFormulas& program = programs[c];
+        vector<long long> nextSlot = slotBase[c];
+        vector<int> formulaAbove(sheet.columnCount, -1);
+
+        for (int i = chunk.firstRow; i < chunk.firstRow + chunk.rowCount; i++) {
+            for (long long k = data.rowStart[i]; k < data.rowStart[i + 1]; k++) {
+                const CellView& cell = data.cells[k];
+                const char* s = data.file->data + cell.offset;
+                Column& cells = sheet.columns[cell.column];
+                int slot = cells.sparse ? (int)nextSlot[cell.column]++ : i;
+                if (cells.sparse) cells.rows[slot] = i;
+
+                if (s[0] == '=') {
+                    int depth = data.workbook ? compileWorkbookFormula(s, cell.length, *data.workbook, data.sheet, program)
+                        : compileFormula(s, cell.length, sheet.rowCount, sheet.columnCount, program);
+                    if (depth > program.maxStackDepth) program.maxStackDepth = depth;
+                    cells.formulas[slot] = formulaBase[c] + program.row.size();
+                    cells.tags[slot] = makeTag(CELL_FORMULA, CELL_NAN);
+
+                    program.row.push_back(i);
+                    program.column.push_back(cell.column);
+                    program.codeStart.push_back(program.code.size());
+                    program.group.push_back(-1);
+                    groupFilledFormula(program, program.row.size() - 1, formulaAbove);
+                }
+                else if (parseNumber(s, cell.length, cells.values[slot])) {
+                    cells.tags[slot] = makeTag(CELL_NUMBER, CELL_OK);
+                    if (!isCanonicalNumber(s, cell.length)) texts[c].push_back({ cell.column, i, cell.offset, cell.length, true });    // 007 is written back as 007
+                }
+                else {
+                    cells.tags[slot] = makeTag(CELL_TEXT, CELL_NAN);
+                    texts[c].push_back({ cell.column, slot, cell.offset, cell.length, false });
+                }
+            }
+        }
+    });
 
-            vector<string> nextIdentifiers = getIdentifiers(s.substr(identifier.length(), s.length() - identifier.length()));
-            cellIdentifiers.insert(cellIdentifiers.end(), nextIdentifiers.begin(), nextIdentifiers.end());
+    /* Text is interned in the order of the file, so the table comes out exactly as if the sheet had been read by a single thread */
 
-            /*Each identifier is added to cellIdentifier, and the recursive call is appendded to the end of cellIdentifiers*/
+    for (int c = 0; c < chunkCount; c++) {
+        for (int t = 0; t < texts[c].size(); t++) {
+            const PendingText& text = texts[c][t];
+            int index = internText(sheet, data.file->data + text.offset, text.length);
+            if (text.number) sheet.columns[text.column].numberTexts[text.slot] = index;
+            else sheet.columns[text.column].values[text.slot] = index;
         }
     }
 
-    return cellIdentifiers;
+    /* Finally the programs of the chunks are put one after the other. Formulas were already numbered in the order of the file, so only the positions of
+        their code, constants, ranges and groups have to be moved along */
 
-    /*After this final return statemenet, cellIdentifiers will contain all of the integers or cell references within s (cellIdentifiers = {A1, 3, B3, C13, BA3} )*/
-}
-
-vector<char> getOperators(const string& s) {
-    /*This function is much more simple than getIdentifier as each operator is simply one character, and a character either is an operator or is not. */
-    vector<char> operators;
-    for (int i = 0; i < s.length(); i++) {
-        if (isOperator(s[i])) operators.push_back(s[i]);
+    if (chunkCount == 1) {
+        sheet.formulas = move(programs[0]);
+        return sheet;
+    }
 
-        /*If any character in s is one of the operators (*, +, - or /), that character is added to the vector */
+    CompiledFormulas& program = sheet.formulas;
+    vector<int> codeBase(chunkCount + 1, 0), constantBase(chunkCount + 1, 0), rangeBase(chunkCount + 1, 0), groupBase(chunkCount + 1, 0);
+    for (int c = 0; c < chunkCount; c++) {
+        codeBase[c + 1] = codeBase[c] + programs[c].code.size();
+        constantBase[c + 1] = constantBase[c] + programs[c].constants.size();
+        rangeBase[c + 1] = rangeBase[c] + programs[c].ranges.size();
+        groupBase[c + 1] = groupBase[c] + programs[c].groups.size();
+        program.maxStackDepth = max(program.maxStackDepth, programs[c].maxStackDepth);
     }
-    return operators;
+    int formulaCount = formulaBase[chunkCount];
+    program.row.resize(formulaCount);
+    program.column.resize(formulaCount);
+    program.group.resize(formulaCount);
+    program.codeStart.resize(formulaCount + 1);
+    program.codeStart[formulaCount] = codeBase[chunkCount];
+    program.code.resize(codeBase[chunkCount]);
+    program.constants.resize(constantBase[chunkCount]);
+    program.ranges.resize(rangeBase[chunkCount]);
+    program.groups.resize(groupBase[chunkCount]);
+
+    forEachChunk(chunkCount, threadCount, [&](int c) {
+        CompiledFormulas& part = programs[c];
+        for (int f = 0; f < part.row.size(); f++) {
+            program.row[formulaBase[c] + f] = part.row[f];
+            program.column[formulaBase[c] + f] = part.column[f];
+            program.codeStart[formulaBase[c] + f] = part.codeStart[f] + codeBase[c];
+            program.group[formulaBase[c] + f] = part.group[f] < 0 ? -1 : part.group[f] + groupBase[c];
+        }
+        for (int k = 0; k < part.code.size(); k++) {
+            Instruction instruction = part.code[k];
+            if (instruction.op == OP_PUSH_CONSTANT) instruction.row += constantBase[c];
+            if (isRangeFunction(instruction.op)) instruction.row += rangeBase[c];
+            program.code[codeBase[c] + k] = instruction;
+        }
+        copy(part.constants.begin(), part.constants.end(), program.constants.begin() + constantBase[c]);
+        copy(part.ranges.begin(), part.ranges.end(), program.ranges.begin() + rangeBase[c]);
+        for (int g = 0; g < part.groups.size(); g++) {
+            FormulaGroup group = part.groups[g];
+            group.codeStart += codeBase[c];
+            group.codeEnd += codeBase[c];
+            program.groups[groupBase[c] + g] = group;
+        }
+        part = CompiledFormulas();
+    });
 
-    /*Will contain all of the operators used in s (operators = {'*', '+', '*'})*/
+    return sheet;
 }
 
+bool outputToFile(const Sheet& sheet, const string& outputFileName, int threadCount) {
+    ofstream output;
+    output.open(outputFileName, ios::binary);
+    /* Opens an output stream to the desired file. */
 
-string performOperation(const string& firstCell, const string& secondCell, const char& firstOperator) {
-    if (firstCell == "#ERROR" || secondCell == "#ERROR") return "#ERROR";
-
-    /*If either of the cells were self referencial, return "#ERROR" */
-
-    /*This function uses a simple switch loop to perform the intended operation on the two cells. */
-
-    string finalVal;
-    int val = 0;
-    switch (firstOperator) {
-    case '+':
-        val = stoi(firstCell) + stoi(secondCell);    // Temporarily convert the strings into integers to perform operations
-        finalVal = to_string(val);                   // convert the final value back into a string to be returned
-        break;
-    case '-':
-        val = stoi(firstCell) - stoi(secondCell);
-        finalVal = to_string(val);
-        break;
-    case '*':
-        val = stoi(firstCell) * stoi(secondCell);
-        finalVal = to_string(val);
-        break;
-    case '/':
-        val = stoi(firstCell) / stoi(secondCell);
-        finalVal = to_string(val);
-        break;
-    default:
-        break; // Can never get here - by definition the vector<char> operators can only contain valid operators
-    }
-    return finalVal;
-}
-
+    /* The rows are formatted in chunks, each into its own buffer, and every buffer is written with a single large write. threadCount chunks are formatted
+        at once (one per thread), and while one batch of chunks is being written the next batch is already being formatted into a second set of buffers.
+        The buffers are reused for every batch, so only 2 x threadCount chunks are ever held in memory. Chunks are written in order, so the file is exactly
+        the same no matter how many threads are used. */
 
-int getColumn(const string& s) {
-    /* Takes a cellIdentifier as an input and finds the correct column based on the string at the end of the cellIdentifier (i.e. AA corresponds to column 27, index 26) */
-    string columnStr;
-    int columnVal = 0;
+    RowIndex index = buildRowIndex(sheet, 0, sheet.rowCount);
+    if (threadCount < 1) threadCount = 1;
 
-    /* Change all column identifiers to upper case to allow for upper or lower in the input spreadsheet */
-    for (int i = 0; !isdigit(s[i]); i++) {
-        if (s[i] == '=') continue;
-        columnStr += toupper(s[i]);
-    }
+    long long rowBytes = sheet.columnCount + 1 + (sheet.rowCount > 0 ? 8 * (index.rowStart[sheet.rowCount] / sheet.rowCount) : 0);
+    int chunkRows = max(1LL, outputChunkBytes / rowBytes);
+    int chunkCount = (sheet.rowCount + chunkRows - 1) / chunkRows;
 
-    /* columnStr contains the string corresponding to the column number - can be thought of as a base-26 number */
+    vector<string> buffers[2];
+    buffers[0].resize(threadCount);
+    buffers[1].resize(threadCount);
+    thread writer;
+    int current = 0;
 
-    for (int i = columnStr.length() - 1; i >= 0; i--) {
-        int charVal = (int)columnStr[i] - 64;
-        charVal *= pow(26, i);
-        columnVal += charVal;
-    }
+    for (int firstChunk = 0; firstChunk < chunkCount; firstChunk += threadCount) {
+        int batchSize = min(threadCount, chunkCount - firstChunk);
+        vector<string>& batch = buffers[current];
 
-    return columnVal - 1;
-}
+        auto format = [&](int t) {
+            int firstRow = (firstChunk + t) * chunkRows;
+            int endRow = min(firstRow + chunkRows, sheet.rowCount);
+            batch[t].clear();
+            formatRows(sheet, index, firstRow, endRow, batch[t]);
+        };
 
-int getRow(const string& s) {
-    /* Much more simple than getColumn(), getRow simply reads the digits on the end of the cellIdentifier and returns the integer that those digits represent.*/
-    int indexOfRow = 0;
-    for (int i = 0; !isdigit(s[i]); i++) indexOfRow++;
-    return stoi(s.substr(indexOfRow, s.length() - indexOfRow)) - 1;
-}
-/* Note - in both getColumn() and getRow(), 1 was subtracted from the final return value. This is mainly for indexing purposes, as the cells in the spreadsheet begin at 1.
-    So, cell A1 would correspond to the first row and first column, which would be sheet[0][0] */
+        if (batchSize == 1) format(0);
+        else {
+            vector<thread> formatters;
+            for (int t = 1; t < batchSize; t++) formatters.push_back(thread(format, t));
+            format(0);
+            for (int t = 0; t < formatters.size(); t++) formatters[t].join();
+        }
 
+        /* The previous batch has to be completely written before this one starts, so the chunks stay in order */
 
-bool circularReference(const vector<string>& cellIdentifiers, const vector<vector<string>>& sheet, const int& currentRow, const int& currentColumn) {
+        if (writer.joinable()) writer.join();
+        writer = thread([&output, &batch, batchSize]() {
+            for (int t = 0; t < batchSize; t++) output.write(batch[t].data(), batch[t].size());
+        });
+        current = 1 - current;
+    }
 
-    /* This function is the reason that many of the other functions required the currentRow and currentColumn to be passed around. In order to know if a cell
-        references itself (or eventually references itself through many different formulas), we need to know what cell is currently being looked at. */
+    if (writer.joinable()) writer.join();
+    output.close();
+    return !output.fail();
+}
 
-    bool circular = false;
-    for (int i = 0; i < cellIdentifiers.size(); i++) {
+void formatRows(const Sheet& sheet, const RowIndex& index, int firstRow, int endRow, string& buffer) {
 
-        /* If a cellIdentifier is a number, it is automatically not self referential and can be ignored */
+    /* The filled cells are visited row by row. Every row is as wide as the sheet, and each empty cell is written as just the delimiter, so the gaps between
+        filled cells are written as runs of delimiters without looking at the empty cells one at a time */
 
-        if (!isNumber(cellIdentifiers[i])) {
-            int row = getRow(cellIdentifiers[i]);
-            int column = getColumn(cellIdentifiers[i]);
+    char digits[24];
 
-            string newIdentifiers = sheet[row][column];
-            vector<string> newCellIdentifiers = getIdentifiers(newIdentifiers);
+    for (int i = firstRow; i < endRow; i++) {
+        int nextColumn = 0;
 
+        for (long long k = index.rowStart[i - index.firstRow]; k < index.rowStart[i - index.firstRow + 1]; k++) {
+            int j = index.column[k];
+            const Column& column = sheet.columns[j];
+            unsigned char tag = column.tags[index.index[k]];
 
-            if (row == currentRow && column == currentColumn) {
+            buffer.append(j - nextColumn, delimiter);    // the empty cells before this one
 
-                /*Check the base case - for if the current row and column are being referenced within the cell */
+            /* Anything that is not empty is written as its value, followed by the delimiter unless it is the last cell of the row */
 
-                return true;
+            if (tagKind(tag) == CELL_TEXT) {
+                const TextSpan& span = sheet.texts[column.values[index.index[k]]];
+                buffer.append(textData(sheet, span), span.length);
             }
-            else {
-
-                /* Checks the more general case - think of any given cellIdentifer as the root node of a tree - where its children nodes are the cells it references.
-                    Then, those referenced cells can also have children if they themselves are formulas. This "else" clause essentially just checks all of those possible
-                    'children' to see if any of them are equal to the current row or column. If they are, it will trigger the "if" clause in a future recursive call
-                    and return true. However, if it never loops back to reference itself, then all leaf nodes are integers and circular = false for all calls. */
-
-                circular = circularReference(newCellIdentifiers, sheet, currentRow, currentColumn);
+            else if (tagError(tag) == CELL_NAN) buffer.append("#NAN");
+            else if (tagError(tag) == CELL_ERROR) buffer.append("#ERROR");
+            else if (tagKind(tag) == CELL_NUMBER && !column.numberTexts.empty() && column.numberTexts.count(i)) {
+                const TextSpan& span = sheet.texts[column.numberTexts.find(i)->second];    // a number written like 007
+                buffer.append(textData(sheet, span), span.length);
             }
+            else buffer.append(digits, formatInteger(column.values[index.index[k]], digits));
+
+            if (j != sheet.columnCount - 1) buffer.push_back(delimiter);  // Ensures no extra tabspaces at end of row
+            nextColumn = j + 1;
         }
 
+        buffer.append(sheet.columnCount - nextColumn, delimiter);
+        buffer.append(lineEnding);
     }
-    return circular;
 }
 
-void outputToFile(const vector<vector<string>>& sheet, const string& outputFileName) {
-    ofstream output;
-    output.open(outputFileName);
-    /* Opens an output stream to the desired file. */
+/* "00" to "99" one after the other, so the two digits of n are digitPairs[2n] and digitPairs[2n + 1] */
+static const char digitPairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
 
+int formatInteger(long long value, char* out) {
 
-    for (int i = 0; i < sheet.size(); i++) {
-        for (int j = 0; j < sheet[i].size(); j++) {
-            if (sheet[i][j] != string(1, delimiter)) {
-                if (j == sheet[i].size() - 1) output << sheet[i][j];  // Ensures no extra tabspaces at end of row 
-                else output << sheet[i][j] << string(1, delimiter);
-            }
-            else {
-                output << sheet[i][j];
-            }
-        }
-        output << endl;
+    /* Writes the digits from the last one backwards, two at a time from the table (so half as many divisions), then moves them to the front in one go.
+        The magnitude is taken as unsigned so that the smallest long long (which has no positive counterpart) still works */
+
+    char digits[24];
+    int position = sizeof(digits);
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+
+    while (magnitude >= 100) {
+        const char* pair = digitPairs + 2 * (magnitude % 100);
+        magnitude /= 100;
+        digits[--position] = pair[1];
+        digits[--position] = pair[0];
+    }
+    if (magnitude >= 10) {
+        digits[--position] = digitPairs[2 * magnitude + 1];
+        digits[--position] = digitPairs[2 * magnitude];
     }
+    else digits[--position] = (char)('0' + magnitude);
 
-    output.close();
+    int length = 0;
+    if (value < 0) out[length++] = '-';
+    memcpy(out + length, digits + position, sizeof(digits) - position);
+    return length + (int)sizeof(digits) - position;
 }
 
 
 /* All of the following functions are very simple helper functions to either format, give a bool relating to whether or not some value has a certain attribute, or the
     index of a desired value within a vector */
 
-    /* Used to format a formula, so that =  A1   + B1 returns as =A1+B1 */
-void removeSpaces(string& s) {
-    string finalS;
-    for (int i = 0; i < s.length(); i++) {
-        if (s[i] != ' ') finalS += s[i];
-    }
-    s = finalS;
-}
-
 /*While anytime this is called, the same effect can be done by isdigit(s[0]), isNumber(s) is more readable, showing that the string as a whole is a valid int rather than just
 the first character */
-bool isNumber(const string& s) {
-    for (int i = 0; i < s.length(); i++) {
+bool isNumber(const char* s, int length) {
+    int i = length > 1 && s[0] == '-' ? 1 : 0;    // a negative number starts with '-'
+    for (; i < length; i++) {
         if (!isdigit(s[i])) return false;
     }
     return true;
 }
 
-
-/*Essentially checks that any given cellIdentifier is a valid input, either an integer or references another valid cell */
-bool validIdentifiers(const vector<string>& cellIdentifiers, const vector<vector<string>>& sheet) {
-
-    for (int i = 0; i < cellIdentifiers.size(); i++) {
-
-        /*If the cellIdentifier is a number, it is automatically acceptable and can be returned immediately */
-
-        if (isNumber(cellIdentifiers[i])) {
-            break;
-        }
-
-        int row = getRow(cellIdentifiers[i]);
-        int column = getColumn(cellIdentifiers[i]);
-
-        if (row > sheet.size() || column > sheet[0].size() || sheet[row][column][0] == delimiter) return false;
-
-        /* If the column or row being referenced by a cellIdentifier is either out of range of the spreadsheet or contains a '\t', it is not a valid identifier. */
-    }
-    return true;
-}
-
-int indexOfMultDiv(const vector<char>& operators) {
-    /* Finds the first index of a '*' or '/' operator because they take precidence in operations. */
-    for (int i = 0; i < operators.size(); i++) {
-        if (operators[i] == '*' || operators[i] == '/') return i;
-    }
-    return -1;
-    /* If there were no multiplicaion or division operators, return a -1. Note: future calls can treat this function as a bool in an if (indexOfMultDiv(operators) > 0) will return
-        true if there were multiplication or division operators and false if there were none. */
-}
-
-bool containsIdentifier(const string& s) {
-    /*Simply checks to make sure that any given formula contains digits. Then, it will either be a reference to another cell or an integer value. */
-    for (int i = 0; i < s.length(); i++) {
-        if (isdigit(s[i])) return true;
-    }
-    return false;
+bool isCanonicalNumber(const char* s, int length) {
+    int i = s[0] == '-' ? 1 : 0;
+    if (s[i] != '0') return true;
+    return i == 0 && length == 1;    // "0" itself, but not "00" or "-0"
 }
 
-bool containsDelimiter(const string& s) {
-    /*Simply tells whether or not a string contains a delimiter or not */
-    for (int i = 0; i < s.length(); i++) {
-        if (s[i] == delimiter) {
-            return true;
-        }
-    }
-    return false;
-}
 
 bool isOperator(const char& c) {
     /* Determines if any given character is one of the valid operators */
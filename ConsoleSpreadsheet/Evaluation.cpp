@@ -0,0 +1,416 @@
+#include "consolespreadsheet.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+void convertFormulasToIntegers(Sheet& sheet, int threadCount) {
+
+    /* Every formula was compiled into a short list of instructions when the sheet was built, so evaluating them does no string work at all. The dependency
+        graph is built once from the references in that compiled code. */
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    buildRangeIndex(sheet);
+    double rangeIndexSeconds = secondsSince(start);
+
+    start = chrono::steady_clock::now();
+    DependencyGraph graph = buildDependencyGraph(sheet);
+    double graphSeconds = secondsSince(start);
+
+    start = chrono::steady_clock::now();
+    vector<char> circular;
+    vector<int> order = topologicalOrder(graph, circular);
+    double orderSeconds = secondsSince(start);
+
+    if (statisticsEnabled) {
+        statistics.rangeIndexSeconds += rangeIndexSeconds;
+        statistics.graphSeconds += graphSeconds;
+        statistics.orderSeconds += orderSeconds;
+        statistics.maxDepth = max(statistics.maxDepth, dependencyDepth(graph, order, circular));
+        prepareStatistics(order.size());
+    }
+
+    /* order lists the formulas so that anything a formula references is evaluated before it, and each result is written into the sheet as soon as it is
+        calculated - so a cell referenced by many other formulas (like A9 in spreadsheet.txt) is only ever calculated once. */
+
+    start = chrono::steady_clock::now();
+    evaluateFormulas(sheet, graph, order, circular, threadCount);
+    if (statisticsEnabled) statistics.cellSeconds += secondsSince(start);
+}
+
+void evaluateFormulaCell(Sheet& sheet, int formula, bool circular, long long* stack) {
+    const CompiledFormulas& program = sheet.formulas;
+    if (formula >= program.row.size()) {
+        updateRangeNode(sheet, formula - program.row.size(), circular);
+        return;
+    }
+    if (program.row[formula] < 0) return;     // the formula has been removed from the sheet
+    Column& column = sheet.columns[program.column[formula]];
+    int index = cellIndex(column, program.row[formula]);
+
+    /* A cell that is part of a cycle can never be evaluated, so it becomes #ERROR. Any cell that depends on it comes later in the order and picks the #ERROR
+        up like any other value. */
+
+    if (circular) {
+        column.tags[index] = makeTag(CELL_FORMULA, CELL_ERROR);
+        return;
+    }
+
+    CellError error = CELL_OK;
+    column.values[index] = runFormula(sheet, formula, stack, error);
+    column.tags[index] = makeTag(CELL_FORMULA, error);
+}
+
+void evaluateFormulaRange(Sheet& sheet, const vector<int>& formulas, int begin, int end, const vector<char>& circular, EvaluationScratch& scratch) {
+    const CompiledFormulas& program = sheet.formulas;
+    bool timed = statisticsEnabled;    // with --stats every cell and every block of the kernel is timed on its own
+
+    for (int i = begin; i < end;) {
+        int formula = formulas[i];
+        int group = formula < program.row.size() ? program.group[formula] : -1;    // range nodes are never in a group
+
+        /* A run of formulas from the same group in consecutive rows (scheduleLevels puts them next to each other) is handed to the column kernel a block at
+            a time. A cell of the group that is part of a cycle ends the run and is left to evaluateFormulaCell, which makes it #ERROR */
+
+        int run = 1;
+        if (group >= 0 && program.row[formula] >= 0 && !circular[formula]) {
+            while (i + run < end && run < kernelBlockRows) {
+                int next = formulas[i + run];
+                if (next >= program.row.size() || program.group[next] != group || program.row[next] != program.row[formula] + run || circular[next]) break;
+                run++;
+            }
+        }
+
+        if (run == 1) {
+            if (timed) {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                evaluateFormulaCell(sheet, formula, circular[formula], scratch.stack.data());
+                countEvaluation(sheet, formula, circular[formula], secondsSince(start));
+            }
+            else evaluateFormulaCell(sheet, formula, circular[formula], scratch.stack.data());
+            i++;
+            continue;
+        }
+
+        chrono::steady_clock::time_point start;
+        if (timed) start = chrono::steady_clock::now();
+        int firstRow = program.row[formula];
+        runFormulaGroup(sheet, group, firstRow, run, scratch);
+
+        Column& column = sheet.columns[program.groups[group].column];
+        for (int r = 0; r < run; r++) {
+            int index = cellIndex(column, firstRow + r);
+            CellError error = (CellError)scratch.errors[r];
+            column.values[index] = error != CELL_OK ? 0 : scratch.lanes[r];
+            column.tags[index] = makeTag(CELL_FORMULA, error);
+        }
+        if (timed) countGroupBlock(sheet, formulas, i, run, secondsSince(start));
+        i += run;
+    }
+}
+
+EvaluationScratch createScratch(const Sheet& sheet) {
+    EvaluationScratch scratch;
+    scratch.stack.resize(sheet.formulas.maxStackDepth);
+    if (!sheet.formulas.groups.empty()) {
+        scratch.lanes.resize((long long)sheet.formulas.maxStackDepth * kernelBlockRows);
+        scratch.errors.resize(kernelBlockRows);
+    }
+    return scratch;
+}
+
+LevelSchedule scheduleLevels(const DependencyGraph& graph, const vector<int>& order, const CompiledFormulas& program) {
+    LevelSchedule schedule;
+    int formulaCount = graph.referenceStart.size() - 1;
+
+    /* The level of a formula is one more than the highest level of anything it references, and formulas that reference no other formula are level 0. Going
+        through the formulas in evaluation order means the levels of the references are always known by the time they are needed (references inside a cycle
+        that have not been reached yet count as 0 - those cells are never actually evaluated, they just become #ERROR). order does not have to hold every
+        formula - anything missing from it has already been evaluated and simply counts as level 0 too. */
+
+    vector<int> level(formulaCount, 0);
+    int levelCount = 0;
+    for (int i = 0; i < order.size(); i++) {
+        int formula = order[i];
+        for (int k = graph.referenceStart[formula]; k < graph.referenceStart[formula + 1]; k++) {
+            int reference = graph.references[k];
+            if (reference != formula && level[reference] + 1 > level[formula]) level[formula] = level[reference] + 1;
+        }
+        if (level[formula] + 1 > levelCount) levelCount = level[formula] + 1;
+    }
+
+    /* Counting sort of the formulas by level. Within a level they stay in evaluation order, so the schedule is the same on every run. When the sheet has
+        formula groups, the formulas are first sorted by group - and within a group by row - so that after the (stable) sort by level the formulas of a group
+        in each level end up side by side in row order, and the column kernel gets long runs of them. Formulas outside of any group come first. When all of a
+        group is being evaluated its members go straight to the position of their row; only part of a group (a recalculation) has to be sorted. */
+
+    const vector<int>* sorted = &order;
+    vector<int> byGroup;
+    if (!program.groups.empty()) {
+        int groupCount = program.groups.size();
+        vector<int> groupOf(order.size());
+        for (int i = 0; i < order.size(); i++) groupOf[i] = order[i] < program.row.size() ? program.group[order[i]] : -1;
+
+        vector<int> groupStart(groupCount + 2, 0);
+        for (int i = 0; i < order.size(); i++) groupStart[groupOf[i] + 2]++;
+        for (int g = 0; g <= groupCount; g++) groupStart[g + 1] += groupStart[g];
+
+        vector<int> nextInGroup(groupStart.begin(), groupStart.end() - 1);
+        byGroup.resize(order.size());
+        for (int i = 0; i < order.size(); i++) {
+            int formula = order[i], g = groupOf[i];
+            if (g >= 0 && groupStart[g + 2] - groupStart[g + 1] == program.groups[g].rowCount) {
+                byGroup[groupStart[g + 1] + program.row[formula] - program.groups[g].firstRow] = formula;
+            }
+            else byGroup[nextInGroup[g + 1]++] = formula;
+        }
+
+        for (int g = 0; g < groupCount; g++) {
+            if (groupStart[g + 2] - groupStart[g + 1] == program.groups[g].rowCount) continue;
+            sort(byGroup.begin() + groupStart[g + 1], byGroup.begin() + groupStart[g + 2], [&](int a, int b) { return program.row[a] < program.row[b]; });
+        }
+        sorted = &byGroup;
+    }
+
+    schedule.levelStart.assign(levelCount + 1, 0);
+    for (int i = 0; i < order.size(); i++) schedule.levelStart[level[order[i]] + 1]++;
+    for (int l = 0; l < levelCount; l++) schedule.levelStart[l + 1] += schedule.levelStart[l];
+
+    vector<int> next(schedule.levelStart.begin(), schedule.levelStart.end() - 1);
+    schedule.formulas.resize(order.size());
+    for (int i = 0; i < sorted->size(); i++) schedule.formulas[next[level[(*sorted)[i]]]++] = (*sorted)[i];
+
+    return schedule;
+}
+
+void evaluateFormulas(Sheet& sheet, const DependencyGraph& graph, const vector<int>& order, const vector<char>& circular, int threadCount) {
+
+    /* No formula in a level references another formula in the same level, so a whole level can be evaluated at once by any number of threads - everything it
+        needs was finished in an earlier level. Every cell is still calculated from exactly the same values as in the serial order, so the results are identical.
+
+        The threads are started once and reused for every level. A level narrower than parallelLevelWidth is not worth waking them for, so the main thread
+        just evaluates it on its own (a long chain of single cells is all narrow levels). Wide levels are handed out in chunks through an atomic counter. With
+        a single thread every level is evaluated that way, which still lets the column kernel work through the groups of each level - but with a single
+        thread and no groups there is nothing to gain from levels, and the formulas are simply evaluated in order (unless they are being timed for --stats). */
+
+    if (order.size() < parallelLevelWidth) threadCount = 1;
+    if (threadCount <= 1 && sheet.formulas.groups.empty() && !statisticsEnabled) {
+        vector<long long> stack(sheet.formulas.maxStackDepth);
+        for (int i = 0; i < order.size(); i++) evaluateFormulaCell(sheet, order[i], circular[order[i]], stack.data());
+        return;
+    }
+
+    LevelSchedule schedule = scheduleLevels(graph, order, sheet.formulas);
+    int levelCount = schedule.levelStart.size() - 1;
+
+    mutex lock;
+    condition_variable levelReady, levelDone;
+    int generation = 0;          // increased every time a new level is handed to the workers
+    int workersBusy = 0;
+    bool finished = false;
+    int levelEnd = 0;
+    atomic<int> nextFormula(0);
+
+    auto evaluateChunks = [&](EvaluationScratch& scratch) {
+        while (true) {
+            int begin = nextFormula.fetch_add(parallelChunkSize);
+            if (begin >= levelEnd) return;
+            int end = min(begin + parallelChunkSize, levelEnd);
+            evaluateFormulaRange(sheet, schedule.formulas, begin, end, circular, scratch);
+        }
+    };
+
+    auto worker = [&]() {
+        EvaluationScratch scratch = createScratch(sheet);
+        int seenGeneration = 0;
+        while (true) {
+            {
+                unique_lock<mutex> guard(lock);
+                levelReady.wait(guard, [&] { return finished || generation != seenGeneration; });
+                if (finished) return;
+                seenGeneration = generation;
+            }
+
+            evaluateChunks(scratch);
+
+            unique_lock<mutex> guard(lock);
+            if (--workersBusy == 0) levelDone.notify_one();
+        }
+    };
+
+    vector<thread> workers;
+    for (int t = 1; t < threadCount; t++) workers.push_back(thread(worker));
+
+    EvaluationScratch scratch = createScratch(sheet);
+    for (int l = 0; l < levelCount; l++) {
+        int begin = schedule.levelStart[l], end = schedule.levelStart[l + 1];
+
+        if (workers.empty() || end - begin < parallelLevelWidth) {
+            evaluateFormulaRange(sheet, schedule.formulas, begin, end, circular, scratch);
+            continue;
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+            levelEnd = end;
+            nextFormula = begin;
+            workersBusy = workers.size();
+            generation++;
+        }
+        levelReady.notify_all();
+
+        /* The main thread works on the level too, then waits for the other threads to finish their last chunks before moving on to the next level */
+
+        evaluateChunks(scratch);
+
+        unique_lock<mutex> guard(lock);
+        levelDone.wait(guard, [&] { return workersBusy == 0; });
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        finished = true;
+    }
+    levelReady.notify_all();
+    for (int t = 0; t < workers.size(); t++) workers[t].join();
+}
+
+DependencyGraph buildDependencyGraph(const Sheet& sheet) {
+    DependencyGraph graph;
+    const CompiledFormulas& program = sheet.formulas;
+    int formulaCount = program.row.size();
+
+    /* Records, for every formula, the other formula cells it references. The compiled code already holds the row and column of every reference, so this is
+        just a scan over the instructions. References to integers or plain cells are not edges - they never need to be evaluated first. A range function
+        references the range nodes and cells it reads (see rangeReferences), and the range nodes come after the formulas. */
+
+    int rangeNodeCount = sheet.rangeIndex.summaries.size();
+    vector<long long> keys;
+    graph.referenceStart.reserve(formulaCount + rangeNodeCount + 1);
+
+    for (int formula = 0; formula < formulaCount; formula++) {
+        graph.referenceStart.push_back(graph.references.size());
+        if (program.row[formula] < 0) continue;
+
+        FormulaCode code = formulaCode(program, formula);
+        for (int k = code.begin; k < code.end; k++) {
+            const Instruction& instruction = program.code[k];
+            if (isRangeFunction(instruction.op)) {
+                keys.clear();
+                rangeReferences(sheet, program.ranges[instruction.row], code.rowOffset, keys);
+                for (int r = 0; r < keys.size(); r++) {
+                    int reference = nodeAtKey(sheet, keys[r]);
+                    if (reference >= 0) graph.references.push_back(reference);
+                }
+            }
+            if (instruction.op != OP_PUSH_CELL) continue;
+
+            int reference = formulaAt(sheet, instruction.row + code.rowOffset, instruction.column);
+            if (reference >= 0) graph.references.push_back(reference);
+        }
+    }
+
+    for (int node = 0; node < rangeNodeCount; node++) {
+        graph.referenceStart.push_back(graph.references.size());
+        keys.clear();
+        rangeNodeReferences(sheet, node, keys);
+        for (int r = 0; r < keys.size(); r++) {
+            int reference = nodeAtKey(sheet, keys[r]);
+            if (reference >= 0) graph.references.push_back(reference);
+        }
+    }
+    graph.referenceStart.push_back(graph.references.size());
+
+    return graph;
+}
+
+int nodeAtKey(const Sheet& sheet, long long key) {
+    long long cellCount = (long long)sheet.rowCount * sheet.columnCount;
+    if (key >= cellCount) return sheet.formulas.row.size() + (key - cellCount);
+    return formulaAt(sheet, key % sheet.rowCount, key / sheet.rowCount);
+}
+
+vector<int> topologicalOrder(const DependencyGraph& graph, vector<char>& circular) {
+
+    /* This is Tarjan's algorithm for strongly connected components, written with an explicit stack instead of recursion so that a long chain of references
+        (A1 -> A2 -> ... -> A100000) cannot overflow the call stack. Every node and every reference is looked at a constant number of times.
+
+        A strongly connected component is a group of cells that can all reach each other through their references - so any component with more than one
+        cell, or a cell that references itself, is a cycle. Tarjan's algorithm finishes a component only after everything it references has been finished,
+        which is exactly the order the formulas need to be evaluated in. */
+
+    int nodeCount = graph.referenceStart.size() - 1;
+    vector<int> order;
+    vector<int> index(nodeCount, -1);     // the order in which the search first reached each node
+    vector<int> lowLink(nodeCount, 0);    // the smallest index reachable from the node while it is still on the component stack
+    vector<char> onStack(nodeCount, 0);
+    vector<int> componentStack;
+    vector<int> callStack;                // nodes whose references are still being searched
+    vector<int> nextReference(nodeCount, 0);
+    int nextIndex = 0;
+
+    circular.assign(nodeCount, 0);
+    order.reserve(nodeCount);
+
+    for (int root = 0; root < nodeCount; root++) {
+        if (index[root] >= 0) continue;
+
+        index[root] = lowLink[root] = nextIndex++;
+        nextReference[root] = graph.referenceStart[root];
+        componentStack.push_back(root);
+        onStack[root] = 1;
+        callStack.push_back(root);
+
+        while (!callStack.empty()) {
+            int node = callStack.back();
+
+            if (nextReference[node] < graph.referenceStart[node + 1]) {
+                int reference = graph.references[nextReference[node]++];
+
+                if (reference == node) circular[node] = 1;    // references itself directly
+
+                if (index[reference] < 0) {
+
+                    /* First time this reference is reached - search it before continuing with the rest of node's references (this is the recursive call) */
+
+                    index[reference] = lowLink[reference] = nextIndex++;
+                    nextReference[reference] = graph.referenceStart[reference];
+                    componentStack.push_back(reference);
+                    onStack[reference] = 1;
+                    callStack.push_back(reference);
+                }
+                else if (onStack[reference] && index[reference] < lowLink[node]) {
+                    lowLink[node] = index[reference];
+                }
+                continue;
+            }
+
+            /* All of node's references have been searched, so "return" to whichever node reached it */
+
+            callStack.pop_back();
+            if (!callStack.empty()) {
+                int parent = callStack.back();
+                if (lowLink[node] < lowLink[parent]) lowLink[parent] = lowLink[node];
+            }
+
+            if (lowLink[node] == index[node]) {
+
+                /* node is the first cell of a component - everything above it on componentStack belongs to the same component */
+
+                int componentStart = componentStack.size() - 1;
+                while (componentStack[componentStart] != node) componentStart--;
+
+                bool cycle = componentStack.size() - componentStart > 1;
+                for (int k = componentStart; k < componentStack.size(); k++) {
+                    int member = componentStack[k];
+                    onStack[member] = 0;
+                    if (cycle) circular[member] = 1;
+                    order.push_back(member);
+                }
+                componentStack.resize(componentStart);
+            }
+        }
+    }
+
+    return order;
+}
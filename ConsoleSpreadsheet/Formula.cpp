@@ -0,0 +1,253 @@
+#include "consolespreadsheet.h"
+#include <cstring>
+
+static void parseSheetName(const char* s, int length, int& i, string& name) {
+
+    /* A reference can start with the name of a sheet followed by '!', like Sheet2!B7. The name is made of letters, digits and '_', the same as a file name
+        without its extension */
+
+    int j = i;
+    while (j < length && (isalnum((unsigned char)s[j]) || s[j] == '_')) j++;
+    if (j == i || j >= length || s[j] != '!') return;
+    name.assign(s + i, j - i);
+    i = j + 1;
+}
+
+static bool sheetBounds(const Workbook* workbook, int sheet, const string& name, int& rowCount, int& columnCount, int& firstColumn) {
+
+    /* Finds the size of the sheet a reference points into, and where its columns start. Only a sheet of a workbook can reference another sheet - anywhere
+        else a sheet name makes the formula unreadable. A sheet that is not part of the workbook has no cells at all, so referencing it gives #NAN */
+
+    firstColumn = 0;
+    if (workbook == NULL) return name.empty();
+
+    int target = sheet;
+    if (!name.empty()) target = find(workbook->names.begin(), workbook->names.end(), name) - workbook->names.begin();
+    if (target == workbook->names.size()) {
+        rowCount = columnCount = 0;
+        return true;
+    }
+    rowCount = workbook->rowCount[target];
+    columnCount = workbook->columnCount[target];
+    firstColumn = workbook->firstColumn[target];
+    return true;
+}
+
+static int compile(const char* s, int length, int sheetRows, int sheetColumns, const Workbook* workbook, int sheet, CompiledFormulas& program) {
+
+    /* A formula is a list of operands (integers, cell identifiers or range functions) separated by operators. It is turned into postfix order with a small operator stack:
+        '*' and '/' bind tighter than '+' and '-', and operators of the same kind are done left to right. Because every operand pushes one value and every
+        operator pops two and pushes one, depth tracks how large the stack gets while the formula runs. */
+
+    int start = program.code.size();
+    int firstRange = program.ranges.size();
+    char pending[2];            // operators waiting for their right hand side - at most one '+'/'-' followed by one '*'/'/'
+    int pendingCount = 0;
+    int depth = 0, maxDepth = 0;
+    bool expectOperand = true;
+    bool valid = true;
+    bool sheetNames = memchr(s, '!', length) != NULL;    // almost no formula names a sheet, so most never have to look for one
+
+    for (int i = 1; i < length;) {
+        if (s[i] == ' ') {
+            i++;
+            continue;
+        }
+
+        if (expectOperand) {
+            Instruction instruction = { OP_PUSH_NAN, 0, 0 };
+            string sheetName;
+            int rowCount = sheetRows, columnCount = sheetColumns, firstColumn;
+            if (sheetNames) parseSheetName(s, length, i, sheetName);
+
+            if (sheetName.empty() && isdigit(s[i])) {
+                instruction.op = OP_PUSH_CONSTANT;
+                instruction.row = program.constants.size();
+                program.constants.push_back(parseInteger(s, length, i));
+            }
+            else if (sheetName.empty() && isRangeFunctionName(s, length, i)) {
+
+                /* A range function - like a cell, a range reaching outside of the spreadsheet (or of its own sheet) can never be valid */
+
+                OpCode op;
+                CellRange range;
+                if (!parseRangeFunction(s, length, i, op, range, sheetName) || !sheetBounds(workbook, sheet, sheetName, rowCount, columnCount, firstColumn)) {
+                    valid = false;
+                    break;
+                }
+                if (range.lastRow < rowCount && range.lastColumn < columnCount) {
+                    range.firstColumn += firstColumn;
+                    range.lastColumn += firstColumn;
+                    instruction.op = op;
+                    instruction.row = program.ranges.size();
+                    program.ranges.push_back(range);
+                }
+            }
+            else {
+                int row, column;
+                if (!parseCellIdentifier(s, length, i, row, column) || !sheetBounds(workbook, sheet, sheetName, rowCount, columnCount, firstColumn)) {
+                    valid = false;
+                    break;
+                }
+
+                /* A reference outside of the spreadsheet can never be valid, so it is compiled straight into a #NAN. In a workbook every sheet is loaded
+                    into its own columns of one Sheet, so the column is moved along to where the sheet starts */
+
+                if (row < rowCount && column < columnCount) {
+                    instruction.op = OP_PUSH_CELL;
+                    instruction.row = row;
+                    instruction.column = column + firstColumn;
+                }
+            }
+
+            program.code.push_back(instruction);
+            if (++depth > maxDepth) maxDepth = depth;
+            expectOperand = false;
+        }
+        else {
+            if (!isOperator(s[i])) {
+                valid = false;
+                break;
+            }
+
+            /* Anything already waiting that binds at least as tightly as this operator can be done now */
+
+            bool multDiv = s[i] == '*' || s[i] == '/';
+            while (pendingCount > 0 && (!multDiv || pending[pendingCount - 1] == '*' || pending[pendingCount - 1] == '/')) {
+                char op = pending[--pendingCount];
+                program.code.push_back({ op == '+' ? OP_ADD : op == '-' ? OP_SUBTRACT : op == '*' ? OP_MULTIPLY : OP_DIVIDE, 0, 0 });
+                depth--;
+            }
+            pending[pendingCount++] = s[i++];
+            expectOperand = true;
+        }
+    }
+
+    while (pendingCount > 0) {
+        char op = pending[--pendingCount];
+        program.code.push_back({ op == '+' ? OP_ADD : op == '-' ? OP_SUBTRACT : op == '*' ? OP_MULTIPLY : OP_DIVIDE, 0, 0 });
+    }
+
+    /* If the loop stopped early (something that is neither an operand nor an operator), the formula was empty or it ended on an operator, it cannot be
+        read - the whole formula is replaced by a single #NAN */
+
+    if (!valid || expectOperand) {
+        program.code.resize(start);
+        program.ranges.resize(firstRange);
+        program.code.push_back({ OP_PUSH_NAN, 0, 0 });
+        return 1;
+    }
+
+    return maxDepth;
+}
+
+int compileFormula(const char* s, int length, int rowCount, int columnCount, CompiledFormulas& program) {
+    return compile(s, length, rowCount, columnCount, NULL, 0, program);
+}
+
+int compileWorkbookFormula(const char* s, int length, const Workbook& workbook, int sheet, CompiledFormulas& program) {
+    return compile(s, length, workbook.rowCount[sheet], workbook.columnCount[sheet], &workbook, sheet, program);
+}
+
+long long runFormula(const Sheet& sheet, int formula, long long* stack, CellError& error) {
+    return runFormulaCode(sheet.formulas, formula, SheetCellReader{ sheet }, stack, error);
+}
+
+bool SheetCellReader::cell(int row, int column, unsigned char& tag, long long& value) const {
+    const Column& cells = sheet.columns[column];
+    int index = cellIndex(cells, row);
+    if (index < 0) return false;
+    tag = cells.tags[index];
+    value = cells.values[index];
+    return true;
+}
+
+RangeSummary SheetCellReader::range(const CellRange& range, int rowOffset) const {
+    return summarizeRange(sheet, range, rowOffset);
+}
+
+bool isRangeFunctionName(const char* s, int length, int i) {
+    while (i < length && isalpha(s[i])) i++;
+    return i < length && s[i] == '(';
+}
+
+bool parseRangeFunction(const char* s, int length, int& i, OpCode& op, CellRange& range, string& sheetName) {
+
+    /* The name of the function comes first (in upper or lower case), then the range in brackets - two cell identifiers separated by ':', or a single cell
+        for a range of one. The corners can be given in any order, so B10:A1 is the same range as A1:B10. A range on another sheet starts with the name of
+        the sheet, like SUM(Sheet2!A1:A10). */
+
+    const char* names[] = { "SUM", "MIN", "MAX", "COUNT" };
+    const OpCode functions[] = { OP_SUM, OP_MIN, OP_MAX, OP_COUNT };
+
+    int nameEnd = i;
+    string name;
+    while (nameEnd < length && isalpha(s[nameEnd])) name += (char)toupper(s[nameEnd++]);
+
+    int function = 0;
+    while (function < 4 && name != names[function]) function++;
+    if (function == 4 || nameEnd >= length || s[nameEnd] != '(') return false;
+    op = functions[function];
+    i = nameEnd + 1;
+
+    int firstRow, firstColumn, lastRow, lastColumn;
+    while (i < length && s[i] == ' ') i++;
+    parseSheetName(s, length, i, sheetName);
+    if (!parseCellIdentifier(s, length, i, firstRow, firstColumn)) return false;
+    lastRow = firstRow;
+    lastColumn = firstColumn;
+
+    while (i < length && s[i] == ' ') i++;
+    if (i < length && s[i] == ':') {
+        i++;
+        while (i < length && s[i] == ' ') i++;
+        if (!parseCellIdentifier(s, length, i, lastRow, lastColumn)) return false;
+        while (i < length && s[i] == ' ') i++;
+    }
+    if (i >= length || s[i] != ')') return false;
+    i++;
+
+    range.firstRow = min(firstRow, lastRow);
+    range.lastRow = max(firstRow, lastRow);
+    range.firstColumn = min(firstColumn, lastColumn);
+    range.lastColumn = max(firstColumn, lastColumn);
+    return true;
+}
+
+bool parseCellIdentifier(const char* s, int length, int& i, int& row, int& column) {
+
+    /* The letters at the start of the identifier are the column, which can be thought of as a base-26 number where A = 1, B = 2, ... Z = 26, so AA is
+        column 27 and AB is column 28. Upper or lower case letters are both allowed. */
+
+    int j = i;
+    long long columnVal = 0;
+    while (j < length && isalpha(s[j])) {
+        columnVal = columnVal * 26 + (toupper(s[j]) - 'A' + 1);
+        if (columnVal > INT_MAX) return false;
+        j++;
+    }
+
+    /* The digits following the letters are the row */
+
+    if (j == i || j >= length || !isdigit(s[j])) return false;
+    long long rowVal = parseInteger(s, length, j);
+    if (rowVal < 1 || rowVal > INT_MAX) return false;
+
+    /* Note - 1 is subtracted from both values for indexing purposes, as the cells in the spreadsheet begin at 1. So, cell A1 would correspond to the first
+        row and first column, which would be sheet[0][0] */
+
+    row = rowVal - 1;
+    column = columnVal - 1;
+    i = j;
+    return true;
+}
+
+long long parseInteger(const char* s, int length, int& i) {
+    long long value = 0;
+    while (i < length && isdigit(s[i])) {
+        int digit = s[i] - '0';
+        value = value > (LLONG_MAX - digit) / 10 ? LLONG_MAX : value * 10 + digit;    // too many digits for 64 bits stays at the largest value
+        i++;
+    }
+    return value;
+}
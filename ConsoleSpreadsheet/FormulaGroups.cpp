@@ -0,0 +1,158 @@
+#include "consolespreadsheet.h"
+#include <cstring>
+
+/*
+    Formula groups. Most large sheets are a few formulas filled down thousands of rows (=A1+B1, =A2+B2, =A3+B3, ...). Written in relative (R1C1) form these
+    are all the same formula - "the cell in column A of this row plus the cell in column B of this row" - so the loader keeps the compiled code once for the
+    whole run instead of once per cell - and never compiles more than one of them into memory at a time. When the group is evaluated, a whole block of its rows goes through each instruction at once: every reference becomes
+    a slice of a column's values array, and every operator works on two slices at a time, which is what SIMD instructions are made for.
+*/
+
+void groupFilledFormula(CompiledFormulas& program, int formula, vector<int>& formulaAbove) {
+    int column = program.column[formula];
+    int above = formulaAbove[column];
+    formulaAbove[column] = formula;
+
+    /* The sheet is loaded row by row, so the last formula stored in a column is the one above this one - if it is in the row just above. When this formula is
+        that one filled down it joins its group (starting a new group if the one above is not in one yet), and the code it was just compiled into is dropped
+        again, along with its constants and ranges. A group ends up costing no more code than a single formula. */
+
+    if (above < 0 || program.row[above] + 1 != program.row[formula] || !isFilledDown(program, above, formula)) return;
+
+    if (program.group[above] < 0) {
+        program.group[above] = program.groups.size();
+        program.groups.push_back({ column, program.row[above], 1, program.codeStart[above], program.codeStart[above + 1] });
+    }
+    program.group[formula] = program.group[above];
+    program.groups[program.group[formula]].rowCount++;
+
+    int constantCount = 0, rangeCount = 0;
+    for (int k = program.codeStart[formula]; k < program.codeStart[formula + 1]; k++) {
+        if (program.code[k].op == OP_PUSH_CONSTANT) constantCount++;
+        if (isRangeFunction(program.code[k].op)) rangeCount++;
+    }
+    program.constants.resize(program.constants.size() - constantCount);
+    program.ranges.resize(program.ranges.size() - rangeCount);
+    program.code.resize(program.codeStart[formula]);
+    program.codeStart[formula + 1] = program.codeStart[formula];
+}
+
+bool isFilledDown(const CompiledFormulas& program, int above, int below) {
+    FormulaCode code = formulaCode(program, above);
+    int length = code.end - code.begin;
+    if (program.codeStart[below + 1] - program.codeStart[below] != length) return false;
+
+    /* References to cells outside of the sheet were already compiled into #NAN, so two formulas only match if they go out of range in the same places */
+
+    for (int k = 0; k < length; k++) {
+        const Instruction& a = program.code[code.begin + k];
+        const Instruction& b = program.code[program.codeStart[below] + k];
+        if (a.op != b.op) return false;
+        if (a.op == OP_PUSH_CONSTANT && program.constants[a.row] != program.constants[b.row]) return false;
+        if (a.op == OP_PUSH_CELL && (a.column != b.column || a.row + code.rowOffset + 1 != b.row)) return false;
+        if (isRangeFunction(a.op)) {
+            const CellRange& x = program.ranges[a.row];
+            const CellRange& y = program.ranges[b.row];
+            if (x.firstColumn != y.firstColumn || x.lastColumn != y.lastColumn) return false;
+            if (x.firstRow + code.rowOffset + 1 != y.firstRow || x.lastRow + code.rowOffset + 1 != y.lastRow) return false;
+        }
+    }
+    return true;
+}
+
+void runFormulaGroup(const Sheet& sheet, int group, int firstRow, int rowCount, EvaluationScratch& scratch) {
+
+    /* The same stack machine as runFormula, except that every entry of the stack is a block of rowCount values (one for each row) rather than a single
+        value. Errors work the same way too: errors[i] keeps the largest error seen by row i. */
+
+    const CompiledFormulas& program = sheet.formulas;
+    const FormulaGroup& shared = program.groups[group];
+    int rowOffset = firstRow - shared.firstRow;
+    unsigned char* errors = scratch.errors.data();
+    memset(errors, CELL_OK, rowCount);
+
+    int top = 0;
+    for (int k = shared.codeStart; k < shared.codeEnd; k++) {
+        const Instruction& instruction = program.code[k];
+        long long* lane = scratch.lanes.data() + (long long)top * kernelBlockRows;    // the first free entry - operators work on the two below it
+
+        switch (instruction.op) {
+        case OP_PUSH_CONSTANT:
+            fill(lane, lane + rowCount, program.constants[instruction.row]);
+            top++;
+            break;
+        case OP_PUSH_CELL: {
+            const Column& column = sheet.columns[instruction.column];
+            int row = instruction.row + rowOffset;
+
+            /* In a dense column the referenced rows are one contiguous slice. A sparse column is walked alongside the rows instead, and the rows it does not
+                store are empty cells */
+
+            if (!column.sparse) {
+                memcpy(lane, column.values.data() + row, rowCount * sizeof(long long));
+                mergeTagErrors(errors, column.tags.data() + row, rowCount);
+            }
+            else {
+                int index = lower_bound(column.rows.begin(), column.rows.end(), row) - column.rows.begin();
+                for (int i = 0; i < rowCount; i++) {
+                    while (index < column.rows.size() && column.rows[index] < row + i) index++;
+                    if (index == column.rows.size() || column.rows[index] != row + i) {
+                        errors[i] = CELL_NAN;
+                        lane[i] = 0;
+                        continue;
+                    }
+                    CellError cellError = tagError(column.tags[index]);
+                    if (cellError > errors[i]) errors[i] = cellError;
+                    lane[i] = column.values[index];
+                }
+            }
+            top++;
+            break;
+        }
+        case OP_PUSH_NAN:
+            memset(errors, CELL_NAN, rowCount);
+            fill(lane, lane + rowCount, 0);
+            top++;
+            break;
+        case OP_SUM:
+        case OP_MIN:
+        case OP_MAX:
+        case OP_COUNT:
+
+            /* Every row has its own range, so these are looked up one row at a time - each lookup is only a few tree nodes */
+
+            for (int i = 0; i < rowCount; i++) {
+                CellError error = (CellError)errors[i];
+                lane[i] = rangeFunctionValue(instruction.op, summarizeRange(sheet, program.ranges[instruction.row], rowOffset + i), error);
+                errors[i] = error;
+            }
+            top++;
+            break;
+        case OP_ADD:
+            addVectors(lane - 2 * kernelBlockRows, lane - kernelBlockRows, rowCount);
+            top--;
+            break;
+        case OP_SUBTRACT:
+            subtractVectors(lane - 2 * kernelBlockRows, lane - kernelBlockRows, rowCount);
+            top--;
+            break;
+        case OP_MULTIPLY:
+            multiplyVectors(lane - 2 * kernelBlockRows, lane - kernelBlockRows, rowCount);
+            top--;
+            break;
+        case OP_DIVIDE: {
+            long long* a = lane - 2 * kernelBlockRows;
+            const long long* b = lane - kernelBlockRows;
+            for (int i = 0; i < rowCount; i++) {
+                if (b[i] == 0) {
+                    errors[i] = CELL_NAN;    // dividing by zero does not give a number
+                    a[i] = 0;
+                }
+                else a[i] = wrapDivide(a[i], b[i]);
+            }
+            top--;
+            break;
+        }
+        }
+    }
+}
@@ -0,0 +1,155 @@
+#include "consolespreadsheet.h"
+
+/*
+    A sheet that stays in memory between edits, for working with a sheet interactively rather than through the whole file -> file pipeline. Cells are changed
+    with setCell, and only the formulas that depend (directly or through other formulas) on a changed cell are evaluated again.
+
+    Edits are batched: setCell only records what changed, and the recalculation happens once, the next time a value is asked for (or when recalculate is
+    called). Changing a handful of inputs on a million cell sheet then costs time in proportion to the cells that actually depend on them.
+*/
+
+LiveSheet openLiveSheet(Sheet sheet, int threadCount) {
+    LiveSheet live;
+    live.sheet = move(sheet);
+    live.threadCount = threadCount;
+
+    rebuildDependencies(live);
+
+    /* The first calculation has to evaluate everything, exactly like convertFormulasToIntegers */
+
+    evaluateFormulas(live.sheet, live.graph, live.order, live.circular, threadCount);
+    live.changedCells.clear();
+
+    return live;
+}
+
+void rebuildDependencies(LiveSheet& live) {
+
+    /* New range trees have to be calculated from scratch, so all of their nodes count as changed */
+
+    if (buildRangeIndex(live.sheet)) {
+        for (int node = 0; node < live.sheet.rangeIndex.summaries.size(); node++) live.changedCells.push_back(rangeNodeKey(live.sheet, node));
+    }
+    live.graph = buildDependencyGraph(live.sheet);
+    live.order = topologicalOrder(live.graph, live.circular);
+
+    live.position.assign(live.order.size(), 0);
+    for (int i = 0; i < live.order.size(); i++) live.position[live.order[i]] = i;
+
+    buildReverseIndex(live);
+    live.structureChanged = false;
+}
+
+void buildReverseIndex(LiveSheet& live) {
+
+    /* The reverse edges: for every cell that some formula references, which formulas reference it. These are built from (cell, formula) pairs sorted by
+        cell, so the formulas referencing a cell can be found with a binary search. Unlike the dependency graph this includes references to plain cells,
+        since those are exactly the cells whose edits have to be followed. Range nodes are treated like formulas, under their own keys. */
+
+    const CompiledFormulas& program = live.sheet.formulas;
+    int formulaCount = program.row.size();
+    vector<pair<long long, int>> pairs;
+    vector<long long> keys;
+    for (int formula = 0; formula < formulaCount; formula++) {
+        if (program.row[formula] < 0) continue;
+        FormulaCode code = formulaCode(program, formula);
+        for (int k = code.begin; k < code.end; k++) {
+            const Instruction& instruction = program.code[k];
+            if (instruction.op == OP_PUSH_CELL) pairs.push_back(make_pair(cellKey(live.sheet, instruction.row + code.rowOffset, instruction.column), formula));
+            if (isRangeFunction(instruction.op)) {
+                keys.clear();
+                rangeReferences(live.sheet, program.ranges[instruction.row], code.rowOffset, keys);
+                for (int r = 0; r < keys.size(); r++) pairs.push_back(make_pair(keys[r], formula));
+            }
+        }
+    }
+    for (int node = 0; node < live.sheet.rangeIndex.summaries.size(); node++) {
+        keys.clear();
+        rangeNodeReferences(live.sheet, node, keys);
+        for (int r = 0; r < keys.size(); r++) pairs.push_back(make_pair(keys[r], formulaCount + node));
+    }
+    sort(pairs.begin(), pairs.end());
+    pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+
+    ReverseIndex& index = live.referencedBy;
+    index.cells.clear();
+    index.start.clear();
+    index.formulas.resize(pairs.size());
+    for (int k = 0; k < pairs.size(); k++) {
+        if (k == 0 || pairs[k].first != pairs[k - 1].first) {
+            index.cells.push_back(pairs[k].first);
+            index.start.push_back(k);
+        }
+        index.formulas[k] = pairs[k].second;
+    }
+    index.start.push_back(pairs.size());
+}
+
+bool setCell(LiveSheet& live, int row, int column, const string& contents) {
+    Sheet& sheet = live.sheet;
+    if (row < 0 || row >= sheet.rowCount || column < 0 || column >= sheet.columnCount) return false;
+
+    /* If a formula is removed or added, the references between the cells change, so the dependency graph will have to be rebuilt before recalculating.
+        Changing a plain value only needs its dependents evaluated again. */
+
+    if (formulaAt(sheet, row, column) >= 0 || (contents.length() > 0 && contents[0] == '=')) live.structureChanged = true;
+
+    clearCell(sheet, row, column);
+    setCellContents(sheet, row, column, contents.data(), contents.length());
+    live.changedCells.push_back(cellKey(sheet, row, column));
+
+    return true;
+}
+
+string getCellValue(LiveSheet& live, int row, int column) {
+    if (row < 0 || row >= live.sheet.rowCount || column < 0 || column >= live.sheet.columnCount) return "";
+
+    if (!live.changedCells.empty()) recalculate(live);
+    return formatCell(live.sheet, row, column);
+}
+
+void recalculate(LiveSheet& live) {
+    if (live.changedCells.empty()) return;
+    if (live.structureChanged) rebuildDependencies(live);
+    else if (live.referencedBy.start.empty()) buildReverseIndex(live);    // a sheet loaded from a snapshot, recalculated for the first time
+
+    Sheet& sheet = live.sheet;
+    const ReverseIndex& index = live.referencedBy;
+
+    /* Finds every formula that depends on a changed cell with a breadth first search over the reverse edges. A changed cell that is itself a formula has to
+        be evaluated too. Every dirty formula is only added once, so this is linear in the number of dependents and their references. */
+
+    int formulaCount = sheet.formulas.row.size();
+    vector<int> dirty;
+    vector<char> isDirty(live.order.size(), 0);
+    vector<long long> queue = live.changedCells;
+
+    for (int q = 0; q < queue.size(); q++) {
+        int formula = nodeAtKey(sheet, queue[q]);
+        if (formula >= 0 && !isDirty[formula]) {
+            isDirty[formula] = 1;
+            dirty.push_back(formula);
+        }
+
+        vector<long long>::const_iterator it = lower_bound(index.cells.begin(), index.cells.end(), queue[q]);
+        if (it == index.cells.end() || *it != queue[q]) continue;
+
+        int k = it - index.cells.begin();
+        for (int d = index.start[k]; d < index.start[k + 1]; d++) {
+            int dependent = index.formulas[d];
+            if (isDirty[dependent]) continue;
+            isDirty[dependent] = 1;
+            dirty.push_back(dependent);
+            if (dependent >= formulaCount) queue.push_back(rangeNodeKey(sheet, dependent - formulaCount));
+            else queue.push_back(cellKey(sheet, sheet.formulas.row[dependent], sheet.formulas.column[dependent]));
+        }
+    }
+
+    /* The dirty formulas are evaluated in the same order as a full calculation, so every one of them sees the new values of the formulas it references */
+
+    sort(dirty.begin(), dirty.end(), [&](int a, int b) { return live.position[a] < live.position[b]; });
+
+    evaluateFormulas(sheet, live.graph, dirty, live.circular, live.threadCount);
+
+    live.changedCells.clear();
+}
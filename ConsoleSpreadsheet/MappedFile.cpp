@@ -0,0 +1,124 @@
+#include "consolespreadsheet.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+    Maps a whole file into memory so that it can be read directly, without copying it into strings first. The operating system pages the file in as it is
+    read, so loading even a multi-gigabyte spreadsheet costs no more memory than the pages actually being looked at.
+*/
+
+static shared_ptr<MappedFile> mapWholeFile(const string& fileName, bool copyOnWrite) {
+    shared_ptr<MappedFile> file = make_shared<MappedFile>();
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return nullptr;
+    file->fileHandle = handle;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size)) return nullptr;
+    file->size = size.QuadPart;
+
+    /* A file of size 0 cannot be mapped, but it is still a valid (empty) spreadsheet */
+
+    if (file->size == 0) return file;
+
+    HANDLE mapping = CreateFileMappingA(handle, NULL, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) return nullptr;
+    file->mappingHandle = mapping;
+
+    file->data = (const char*)MapViewOfFile(mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    if (file->data == NULL) return nullptr;
+#else
+    int descriptor = open(fileName.c_str(), O_RDONLY);
+    if (descriptor < 0) return nullptr;
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0) {
+        close(descriptor);
+        return nullptr;
+    }
+    file->size = status.st_size;
+
+    if (file->size > 0) {
+        void* data = mmap(NULL, file->size, copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (data == MAP_FAILED) {
+            close(descriptor);
+            return nullptr;
+        }
+        if (!copyOnWrite) madvise(data, file->size, MADV_SEQUENTIAL);    // the loader reads an input file front to back exactly once
+        file->data = (const char*)data;
+    }
+
+    /* The mapping stays valid after the descriptor is closed */
+
+    close(descriptor);
+#endif
+
+    return file;
+}
+
+shared_ptr<MappedFile> mapFile(const string& fileName) {
+    return mapWholeFile(fileName, false);
+}
+
+shared_ptr<MappedFile> mapFileCopyOnWrite(const string& fileName) {
+
+    /* A private mapping that can be written to: the first write to a page gives this process a copy of it, and the file itself is never changed */
+
+    return mapWholeFile(fileName, true);
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (data != NULL) UnmapViewOfFile(data);
+    if (mappingHandle != NULL) CloseHandle(mappingHandle);
+    if (fileHandle != NULL) CloseHandle(fileHandle);
+#else
+    if (data != NULL) munmap((void*)data, size);
+#endif
+}
+
+void releaseFileRange(const MappedFile& file, long long begin, long long end) {
+#ifdef _WIN32
+
+    /* Windows has no way of dropping some of the pages of a mapped view - it trims the pages of a read-only mapping on its own when memory runs low */
+
+#else
+
+    /* Only whole pages inside the range can be dropped. The mapping is read-only, so the pages are simply read from the file again if they are needed */
+
+    long long pageSize = sysconf(_SC_PAGESIZE);
+    long long first = (begin + pageSize - 1) / pageSize * pageSize;
+    long long last = end / pageSize * pageSize;
+    if (end == file.size) last = end;    // the last page of the file is only partly filled
+    if (last > first) madvise((void*)(file.data + first), last - first, MADV_DONTNEED);
+#endif
+}
+
+string temporaryFile(const char* prefix) {
+
+    /* A new, empty file of its own in the system's temporary directory, so it never writes over a file the user has. The caller removes it again */
+
+#ifdef _WIN32
+    char directory[MAX_PATH], name[MAX_PATH];
+    if (GetTempPathA(MAX_PATH, directory) == 0 || GetTempFileNameA(directory, prefix, 0, name) == 0) return "";
+    return name;
+#else
+    const char* directory = getenv("TMPDIR");
+    string name = string(directory != NULL && directory[0] != 0 ? directory : "/tmp") + "/" + prefix + "XXXXXX";
+    int file = mkstemp(&name[0]);
+    if (file < 0) return "";
+    close(file);
+    return name;
+#endif
+}
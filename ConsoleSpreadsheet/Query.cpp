@@ -0,0 +1,140 @@
+#include "consolespreadsheet.h"
+#include <cstring>
+#include <unordered_set>
+
+/*
+    Queries for a few cells (--cells C3,D10). When only a total or two are wanted, there is no point in reading every cell of a large sheet and evaluating
+    every formula in it. Instead the file is only split into rows, and the cells are found and read as they are needed: starting from the cells asked for,
+    each formula is compiled to see what it references, and those cells are read in turn, until everything the answer depends on (its dependency cone) has
+    been found. Only those cells go into the sheet, which is then evaluated as usual - so the cost follows the size of the cone, apart from the one quick pass
+    over the file to find where its rows start.
+*/
+
+LineIndex indexLines(const string& fileName) {
+    LineIndex lines;
+    lines.file = mapFile(fileName);
+    lines.rowOffset.push_back(0);
+    if (!lines.file || lines.file->size == 0) return lines;
+
+    /* Rows end the same way as in tokenizeRows. The width of the sheet still has to be known (a reference past the last column is #NAN), so the delimiters
+        of each row are counted, but none of the cells are recorded */
+
+    const char* text = lines.file->data;
+    const char* end = text + lines.file->size;
+    for (const char* row = text; row < end;) {
+        const char* rowEnd = (const char*)memchr(row, '\n', end - row);
+        if (rowEnd == NULL) rowEnd = end;
+        const char* next = rowEnd + 1;
+        if (rowEnd > row && rowEnd[-1] == '\r') rowEnd--;
+
+        int width = (int)count(row, rowEnd, delimiter);
+        if (rowEnd > row && rowEnd[-1] != delimiter) width++;    // the last cell only counts if something is in it
+        if (width > lines.maxWidth) lines.maxWidth = width;
+
+        row = next;
+        lines.rowOffset.push_back(min(next, end) - text);
+    }
+    return lines;
+}
+
+bool findCell(const LineIndex& lines, int row, int column, const char*& s, int& length) {
+    if (row < 0 || row >= lines.rowOffset.size() - 1) return false;
+    const char* cell = lines.file->data + lines.rowOffset[row];
+    const char* rowEnd = lines.file->data + lines.rowOffset[row + 1];
+    if (rowEnd > cell && rowEnd[-1] == '\n') rowEnd--;
+    if (rowEnd > cell && rowEnd[-1] == '\r') rowEnd--;
+
+    for (int j = 0; j < column; j++) {
+        cell = (const char*)memchr(cell, delimiter, rowEnd - cell);
+        if (cell == NULL) return false;
+        cell++;
+    }
+    const char* cellEnd = (const char*)memchr(cell, delimiter, rowEnd - cell);
+    if (cellEnd == NULL) cellEnd = rowEnd;
+
+    s = cell;
+    length = cellEnd - cell;
+    return length > 0;
+}
+
+vector<string> queryCells(const string& fileName, const vector<CellPosition>& cells, int threadCount) {
+    LineIndex lines = indexLines(fileName);
+    int rowCount = lines.rowOffset.size() - 1, columnCount = lines.maxWidth;
+
+    /* Finds the dependency cone, one cell at a time. seen makes sure every cell is only read (and its formula only compiled) once, however many formulas
+        reference it - and cells outside of the sheet are never added, the compiled formula already treats them as #NAN */
+
+    vector<CellPosition> cone, pending;
+    unordered_set<long long> seen;
+    CompiledFormulas program;
+
+    auto visit = [&](int row, int column) {
+        if (row >= rowCount || column >= columnCount) return;
+        if (seen.insert((long long)column * rowCount + row).second) pending.push_back({ row, column });
+    };
+    for (int k = 0; k < cells.size(); k++) visit(cells[k].row, cells[k].column);
+
+    while (!pending.empty()) {
+        CellPosition cell = pending.back();
+        pending.pop_back();
+        const char* s;
+        int length;
+        if (!findCell(lines, cell.row, cell.column, s, length)) continue;
+        cone.push_back(cell);
+        if (s[0] != '=') continue;
+
+        compileFormula(s, length, rowCount, columnCount, program);
+        for (int k = 0; k < program.code.size(); k++) {
+            const Instruction& instruction = program.code[k];
+            if (instruction.op == OP_PUSH_CELL) visit(instruction.row, instruction.column);
+            if (!isRangeFunction(instruction.op)) continue;
+            const CellRange& range = program.ranges[instruction.row];
+            for (int j = range.firstColumn; j <= range.lastColumn; j++) {
+                for (int i = range.firstRow; i <= range.lastRow; i++) visit(i, j);
+            }
+        }
+        program.code.clear();
+        program.constants.clear();
+        program.ranges.clear();
+    }
+
+    /* The cone goes into a sheet of the full size, column by column and row by row within each column, so every cell is added to the end of its column and
+        formulas filled down still form groups. Every other cell is simply left empty */
+
+    sort(cone.begin(), cone.end(), [](const CellPosition& a, const CellPosition& b) { return a.column != b.column ? a.column < b.column : a.row < b.row; });
+
+    Sheet sheet = createSheet(rowCount, columnCount);
+    sheet.source = lines.file;
+    vector<int> formulaAbove(columnCount, -1);
+    for (int k = 0; k < cone.size(); k++) {
+        const char* s;
+        int length;
+        findCell(lines, cone[k].row, cone[k].column, s, length);
+        int formulaCount = sheet.formulas.row.size();
+        setCellContents(sheet, cone[k].row, cone[k].column, s, length);
+        if (sheet.formulas.row.size() > formulaCount) groupFilledFormula(sheet.formulas, formulaCount, formulaAbove);
+    }
+
+    convertFormulasToIntegers(sheet, threadCount);
+
+    vector<string> values;
+    for (int k = 0; k < cells.size(); k++) {
+        if (cells[k].row >= rowCount || cells[k].column >= columnCount) values.push_back("");
+        else values.push_back(formatCell(sheet, cells[k].row, cells[k].column));
+    }
+    return values;
+}
+
+bool parseCellList(const string& list, vector<CellPosition>& cells) {
+    for (size_t start = 0; start <= list.size();) {
+        size_t end = list.find(',', start);
+        if (end == string::npos) end = list.size();
+
+        int i = 0, row, column;
+        string name = list.substr(start, end - start);
+        if (!parseCellIdentifier(name.c_str(), name.size(), i, row, column) || i != name.size()) return false;
+        cells.push_back({ row, column });
+        start = end + 1;
+    }
+    return true;
+}
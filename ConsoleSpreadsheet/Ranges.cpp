@@ -0,0 +1,218 @@
+#include "consolespreadsheet.h"
+
+/*
+    The range functions SUM, MIN, MAX and COUNT. Adding up a range one cell at a time would make =SUM(A1:A100000) cost 100000 steps, and every other range
+    over the same column would pay for it all over again. Instead every column that a range function covers gets a segment tree: each leaf summarizes one
+    block of rangeBlockRows rows, and each node above it combines its two children. Any range of whole blocks is then covered by at most 2 log n nodes, and
+    only the cells at either end that do not make up a whole block are read one by one. The nodes are shared, so overlapping ranges share their work.
+
+    The tree nodes are nodes of the dependency graph as well: a leaf references the cells of its block, a node above it references its children, and a range
+    function references the nodes and end cells it reads. So the summaries are recalculated in order with the formulas - a leaf only after every formula in
+    its block, and a range function only after every node it uses - and a live sheet keeps them current by recalculating the nodes an edit reaches.
+*/
+
+bool buildRangeIndex(Sheet& sheet) {
+    RangeIndex& index = sheet.rangeIndex;
+    const CompiledFormulas& program = sheet.formulas;
+
+    /* A column only needs a tree if some range covers at least a whole block's worth of its rows - shorter ranges are just read cell by cell. Formula
+        groups are checked over every row they run through. */
+
+    vector<int> previousColumns;
+    previousColumns.swap(index.columnOf);
+    int previousLeafCount = index.leafCount;
+
+    index.treeOf.assign(sheet.columnCount, -1);
+    vector<char> needed(sheet.columnCount, 0);
+
+    for (int formula = 0; formula < program.row.size(); formula++) {
+        if (program.row[formula] < 0) continue;
+        FormulaCode code = formulaCode(program, formula);
+        for (int k = code.begin; k < code.end; k++) {
+            if (!isRangeFunction(program.code[k].op)) continue;
+            const CellRange& range = program.ranges[program.code[k].row];
+            if (range.lastRow - range.firstRow + 1 < rangeBlockRows) continue;
+            for (int j = range.firstColumn; j <= range.lastColumn; j++) needed[j] = 1;
+        }
+    }
+
+    for (int j = 0; j < sheet.columnCount; j++) {
+        if (!needed[j]) continue;
+        index.treeOf[j] = index.columnOf.size();
+        index.columnOf.push_back(j);
+    }
+
+    int blockCount = (sheet.rowCount + rangeBlockRows - 1) / rangeBlockRows;
+    index.leafCount = 1;
+    while (index.leafCount < blockCount) index.leafCount *= 2;
+
+    /* When the same columns have trees as before, the summaries are still up to date and are kept */
+
+    if (index.columnOf == previousColumns && index.leafCount == previousLeafCount) return false;
+    index.summaries.assign((long long)index.columnOf.size() * 2 * index.leafCount, RangeSummary());
+    return true;
+}
+
+void rangeReferences(const Sheet& sheet, const CellRange& range, int rowOffset, vector<long long>& keys) {
+    const RangeIndex& index = sheet.rangeIndex;
+    int firstRow = range.firstRow + rowOffset, lastRow = range.lastRow + rowOffset;
+
+    for (int j = range.firstColumn; j <= range.lastColumn; j++) {
+        int tree = index.treeOf[j];
+        int firstBlock = (firstRow + rangeBlockRows - 1) / rangeBlockRows;
+        int endBlock = (lastRow + 1) / rangeBlockRows;
+
+        if (tree < 0 || firstBlock >= endBlock) {
+            for (int i = firstRow; i <= lastRow; i++) keys.push_back(cellKey(sheet, i, j));
+            continue;
+        }
+
+        /* The cells before the first whole block and after the last one, then the fewest tree nodes that exactly cover the whole blocks in between */
+
+        for (int i = firstRow; i < firstBlock * rangeBlockRows; i++) keys.push_back(cellKey(sheet, i, j));
+        for (int i = endBlock * rangeBlockRows; i <= lastRow; i++) keys.push_back(cellKey(sheet, i, j));
+
+        int base = tree * 2 * index.leafCount;
+        for (int l = firstBlock + index.leafCount, r = endBlock + index.leafCount; l < r; l /= 2, r /= 2) {
+            if (l & 1) keys.push_back(rangeNodeKey(sheet, base + l++));
+            if (r & 1) keys.push_back(rangeNodeKey(sheet, base + --r));
+        }
+    }
+}
+
+void rangeNodeReferences(const Sheet& sheet, int node, vector<long long>& keys) {
+    const RangeIndex& index = sheet.rangeIndex;
+    int tree = node / (2 * index.leafCount);
+    int i = node % (2 * index.leafCount);
+    int base = node - i;
+    if (i == 0) return;    // not used
+
+    if (i < index.leafCount) {
+        keys.push_back(rangeNodeKey(sheet, base + 2 * i));
+        keys.push_back(rangeNodeKey(sheet, base + 2 * i + 1));
+        return;
+    }
+
+    int column = index.columnOf[tree];
+    int firstRow = (i - index.leafCount) * rangeBlockRows;
+    int endRow = min(firstRow + rangeBlockRows, sheet.rowCount);
+    for (int row = firstRow; row < endRow; row++) keys.push_back(cellKey(sheet, row, column));
+}
+
+void updateRangeNode(Sheet& sheet, int node, bool circular) {
+    RangeIndex& index = sheet.rangeIndex;
+    int tree = node / (2 * index.leafCount);
+    int i = node % (2 * index.leafCount);
+    int base = node - i;
+
+    RangeSummary summary;
+    if (circular) summary.error = CELL_ERROR;
+    else if (i > 0 && i < index.leafCount) summary = combineSummaries(index.summaries[base + 2 * i], index.summaries[base + 2 * i + 1]);
+    else if (i > 0) {
+
+        /* A leaf reads its block straight out of the column - in a sparse column only the cells that are stored */
+
+        const Column& column = sheet.columns[index.columnOf[tree]];
+        int firstRow = (i - index.leafCount) * rangeBlockRows;
+        int endRow = min(firstRow + rangeBlockRows, sheet.rowCount);
+
+        if (!column.sparse) {
+            for (int row = firstRow; row < endRow; row++) addToSummary(summary, column.tags[row], column.values[row]);
+        }
+        else {
+            int k = lower_bound(column.rows.begin(), column.rows.end(), firstRow) - column.rows.begin();
+            for (; k < column.rows.size() && column.rows[k] < endRow; k++) addToSummary(summary, column.tags[k], column.values[k]);
+        }
+    }
+    index.summaries[node] = summary;
+}
+
+RangeSummary summarizeRange(const Sheet& sheet, const CellRange& range, int rowOffset) {
+
+    /* Exactly the same split as rangeReferences - the end cells are read from the columns and the whole blocks from the tree nodes */
+
+    const RangeIndex& index = sheet.rangeIndex;
+    int firstRow = range.firstRow + rowOffset, lastRow = range.lastRow + rowOffset;
+    RangeSummary total;
+    long long cellsRead = 0, nodesRead = 0;
+
+    for (int j = range.firstColumn; j <= range.lastColumn; j++) {
+        const Column& column = sheet.columns[j];
+        int tree = index.treeOf[j];
+        int firstBlock = (firstRow + rangeBlockRows - 1) / rangeBlockRows;
+        int endBlock = (lastRow + 1) / rangeBlockRows;
+        bool useTree = tree >= 0 && firstBlock < endBlock;
+
+        int headEnd = useTree ? firstBlock * rangeBlockRows - 1 : lastRow;
+        int tailStart = useTree ? endBlock * rangeBlockRows : lastRow + 1;
+        for (int row = firstRow; row <= lastRow; row++) {
+            if (row > headEnd && row < tailStart) row = tailStart;
+            if (row > lastRow) break;
+            int k = cellIndex(column, row);
+            if (k >= 0) addToSummary(total, column.tags[k], column.values[k]);
+            cellsRead++;
+        }
+
+        if (!useTree) continue;
+        int base = tree * 2 * index.leafCount;
+        for (int l = firstBlock + index.leafCount, r = endBlock + index.leafCount; l < r; l /= 2, r /= 2) {
+            if (l & 1) {
+                total = combineSummaries(total, index.summaries[base + l++]);
+                nodesRead++;
+            }
+            if (r & 1) {
+                total = combineSummaries(total, index.summaries[base + --r]);
+                nodesRead++;
+            }
+        }
+    }
+
+    if (statisticsEnabled) {
+        statistics.counters[COUNTER_RANGE_CELLS].fetch_add(cellsRead, memory_order_relaxed);
+        statistics.counters[COUNTER_RANGE_NODE_HITS].fetch_add(nodesRead, memory_order_relaxed);
+    }
+    return total;
+}
+
+void addToSummary(RangeSummary& summary, unsigned char tag, long long value) {
+    CellKind kind = tagKind(tag);
+    if (kind != CELL_NUMBER && kind != CELL_FORMULA) return;    // empty and text cells are skipped
+
+    CellError error = tagError(tag);
+    if (error != CELL_OK) {
+        if (error > summary.error) summary.error = error;
+        return;
+    }
+
+    summary.sum = wrapAdd(summary.sum, value);
+    if (value < summary.min) summary.min = value;
+    if (value > summary.max) summary.max = value;
+    summary.count++;
+}
+
+RangeSummary combineSummaries(const RangeSummary& a, const RangeSummary& b) {
+    RangeSummary summary;
+    summary.sum = wrapAdd(a.sum, b.sum);
+    summary.min = min(a.min, b.min);
+    summary.max = max(a.max, b.max);
+    summary.count = a.count + b.count;
+    summary.error = max(a.error, b.error);
+    return summary;
+}
+
+long long rangeFunctionValue(OpCode op, const RangeSummary& summary, CellError& error) {
+    if (summary.error > error) error = summary.error;
+
+    switch (op) {
+    case OP_SUM:
+        return summary.sum;
+    case OP_COUNT:
+        return summary.count;
+    default:
+        if (summary.count == 0) {
+            error = CELL_NAN;    // the smallest or largest of no numbers at all is not a number
+            return 0;
+        }
+        return op == OP_MIN ? summary.min : summary.max;
+    }
+}
@@ -0,0 +1,278 @@
+#include "consolespreadsheet.h"
+#include <atomic>
+#include <thread>
+
+/*
+    What-if scenarios (--scenarios file). An analyst trying hundreds of scenarios only changes a few inputs of the same sheet in each one, so copying the
+    whole sheet (or even a LiveSheet) for every scenario would spend nearly all of its memory and time on cells that come out exactly the same. Instead every
+    scenario shares one calculated base sheet, which it never changes, and keeps an overlay of its own: the cells it overrides, and the formulas that depend
+    on them (directly or not), with their new values. Reading a cell looks in the overlay first and falls back to the base, so a scenario costs memory and
+    time in proportion to what its overrides affect, and any number of them can be calculated at once on different threads.
+
+    Forking a scenario is just copying it - the base is shared through its shared_ptr, and only the (small) overrides and overlay are copied. A scenario can
+    only change the values of cells (numbers, text or empty), not formulas: a new formula would need its own compiled code and dependency graph, which is
+    what a LiveSheet is for.
+*/
+
+Scenario createScenario(shared_ptr<const LiveSheet> base) {
+    Scenario scenario;
+    scenario.base = base;
+    return scenario;
+}
+
+bool setScenarioCell(Scenario& scenario, int row, int column, const string& contents) {
+    const Sheet& sheet = scenario.base->sheet;
+    if (row < 0 || row >= sheet.rowCount || column < 0 || column >= sheet.columnCount) return false;
+    if (contents.length() > 0 && contents[0] == '=') return false;
+
+    /* The contents are read exactly like setCellContents reads them, except that text is kept in the scenario rather than in the shared sheet */
+
+    unsigned char tag;
+    long long value = 0;
+    if (contents.empty()) tag = makeTag(CELL_EMPTY, CELL_NAN);
+    else if (parseNumber(contents.data(), contents.length(), value)) tag = makeTag(CELL_NUMBER, CELL_OK);
+    else {
+        value = scenario.texts.size();
+        scenario.texts.push_back(contents);
+        tag = makeTag(CELL_TEXT, CELL_NAN);
+    }
+
+    /* Setting the same cell again replaces what it was set to before */
+
+    long long key = cellKey(sheet, row, column);
+    unordered_map<long long, int>::const_iterator it = scenario.overrideIndex.find(key);
+    if (it == scenario.overrideIndex.end()) {
+        scenario.overrideIndex[key] = scenario.overrides.size();
+        scenario.overrides.push_back(key);
+        scenario.overrideTags.push_back(tag);
+        scenario.overrideValues.push_back(value);
+    }
+    else {
+        scenario.overrideTags[it->second] = tag;
+        scenario.overrideValues[it->second] = value;
+    }
+    scenario.calculated = false;
+    return true;
+}
+
+bool ScenarioCellReader::cell(int row, int column, unsigned char& tag, long long& value) const {
+    const Sheet& sheet = scenario.base->sheet;
+    long long key = cellKey(sheet, row, column);
+    vector<long long>::const_iterator it = lower_bound(scenario.cells.begin(), scenario.cells.end(), key);
+    if (it != scenario.cells.end() && *it == key) {
+        int k = it - scenario.cells.begin();
+        tag = scenario.tags[k];
+        value = scenario.values[k];
+        return true;
+    }
+    return SheetCellReader{ sheet }.cell(row, column, tag, value);
+}
+
+RangeSummary ScenarioCellReader::range(const CellRange& range, int rowOffset) const {
+
+    /* The base sheet's summary (and its range trees) still hold for every part of the range the scenario has no cells of its own in. So each column of the
+        range is split around the scenario's cells: the parts between them are summarized from the base, and the scenario's own cells are added one by one.
+        A range over a million rows with one input overridden then costs two summaries of the base and one cell */
+
+    const Sheet& sheet = scenario.base->sheet;
+    int firstRow = range.firstRow + rowOffset, lastRow = range.lastRow + rowOffset;
+    RangeSummary total;
+    for (int j = range.firstColumn; j <= range.lastColumn; j++) {
+        int partStart = firstRow;
+        vector<long long>::const_iterator it = lower_bound(scenario.cells.begin(), scenario.cells.end(), cellKey(sheet, firstRow, j));
+        for (; it != scenario.cells.end() && *it <= cellKey(sheet, lastRow, j); it++) {
+            int row = *it - cellKey(sheet, 0, j);
+            if (row > partStart) total = combineSummaries(total, summarizeRange(sheet, { partStart, row - 1, j, j }, 0));
+            int k = it - scenario.cells.begin();
+            addToSummary(total, scenario.tags[k], scenario.values[k]);
+            partStart = row + 1;
+        }
+        if (partStart <= lastRow) total = combineSummaries(total, summarizeRange(sheet, { partStart, lastRow, j, j }, 0));
+    }
+    return total;
+}
+
+void calculateScenario(Scenario& scenario) {
+    if (scenario.calculated) return;
+    const LiveSheet& live = *scenario.base;
+    const Sheet& sheet = live.sheet;
+    const ReverseIndex& index = live.referencedBy;
+    int formulaCount = sheet.formulas.row.size();
+
+    /* Finds every graph node that depends on an overridden cell, with the same breadth first search over the reverse edges as recalculate. A formula that is
+        itself overridden is not evaluated - it is just a value now - so it is never added, and nothing it references matters any more */
+
+    unordered_map<int, int> local;    // the position of every dirty node in dirty
+    vector<int> dirty;
+    vector<long long> queue = scenario.overrides;
+
+    for (int q = 0; q < queue.size(); q++) {
+        vector<long long>::const_iterator it = lower_bound(index.cells.begin(), index.cells.end(), queue[q]);
+        if (it == index.cells.end() || *it != queue[q]) continue;
+
+        int k = it - index.cells.begin();
+        for (int d = index.start[k]; d < index.start[k + 1]; d++) {
+            int dependent = index.formulas[d];
+            long long key = dependent >= formulaCount ? rangeNodeKey(sheet, dependent - formulaCount)
+                : cellKey(sheet, sheet.formulas.row[dependent], sheet.formulas.column[dependent]);
+            if (local.count(dependent) || scenario.overrideIndex.count(key)) continue;
+            local[dependent] = dirty.size();
+            dirty.push_back(dependent);
+            queue.push_back(key);
+        }
+    }
+
+    /* The dirty nodes are ordered again among themselves, rather than taken in the base sheet's order, because overriding a formula can break a cycle it
+        was part of. Every cycle through a dirty node is made of dirty nodes only (each one depends on the next), so this finds exactly the cycles left */
+
+    DependencyGraph graph;
+    graph.referenceStart.push_back(0);
+    for (int n = 0; n < dirty.size(); n++) {
+        for (int r = live.graph.referenceStart[dirty[n]]; r < live.graph.referenceStart[dirty[n] + 1]; r++) {
+            unordered_map<int, int>::const_iterator it = local.find(live.graph.references[r]);
+            if (it != local.end()) graph.references.push_back(it->second);
+        }
+        graph.referenceStart.push_back(graph.references.size());
+    }
+    vector<char> circular;
+    vector<int> order = topologicalOrder(graph, circular);
+
+    /* The overlay holds the overrides and every dirty formula, sorted by cell so that a range can find the scenario's cells within it. The range nodes are
+        not needed: ScenarioCellReader::range reads the base sheet's trees around the scenario's cells */
+
+    vector<pair<long long, int>> cells;
+    for (int k = 0; k < scenario.overrides.size(); k++) cells.push_back(make_pair(scenario.overrides[k], k));
+    for (int n = 0; n < dirty.size(); n++) {
+        if (dirty[n] < formulaCount) cells.push_back(make_pair(cellKey(sheet, sheet.formulas.row[dirty[n]], sheet.formulas.column[dirty[n]]), -1));
+    }
+    sort(cells.begin(), cells.end());
+
+    scenario.cells.resize(cells.size());
+    scenario.tags.resize(cells.size());
+    scenario.values.resize(cells.size());
+    for (int k = 0; k < cells.size(); k++) {
+        scenario.cells[k] = cells[k].first;
+        scenario.tags[k] = cells[k].second >= 0 ? scenario.overrideTags[cells[k].second] : makeTag(CELL_FORMULA, CELL_NAN);
+        scenario.values[k] = cells[k].second >= 0 ? scenario.overrideValues[cells[k].second] : 0;
+    }
+
+    /* Every dirty formula sees the new values of the dirty formulas it references, since they come first in order */
+
+    vector<long long> stack(max(1, sheet.formulas.maxStackDepth));
+    for (int i = 0; i < order.size(); i++) {
+        int formula = dirty[order[i]];
+        if (formula >= formulaCount) continue;
+        long long key = cellKey(sheet, sheet.formulas.row[formula], sheet.formulas.column[formula]);
+        int k = lower_bound(scenario.cells.begin(), scenario.cells.end(), key) - scenario.cells.begin();
+
+        if (circular[order[i]]) {
+            scenario.tags[k] = makeTag(CELL_FORMULA, CELL_ERROR);
+            continue;
+        }
+        CellError error = CELL_OK;
+        scenario.values[k] = runFormulaCode(sheet.formulas, formula, ScenarioCellReader{ scenario }, stack.data(), error);
+        scenario.tags[k] = makeTag(CELL_FORMULA, error);
+    }
+
+    scenario.calculated = true;
+}
+
+string getScenarioValue(Scenario& scenario, int row, int column) {
+    const Sheet& sheet = scenario.base->sheet;
+    if (row < 0 || row >= sheet.rowCount || column < 0 || column >= sheet.columnCount) return "";
+    calculateScenario(scenario);
+
+    vector<long long>::const_iterator it = lower_bound(scenario.cells.begin(), scenario.cells.end(), cellKey(sheet, row, column));
+    if (it == scenario.cells.end() || *it != cellKey(sheet, row, column)) return formatCell(sheet, row, column);
+
+    /* The same formatting as formatCell, with the text of an overridden text cell kept in the scenario */
+
+    int k = it - scenario.cells.begin();
+    unsigned char tag = scenario.tags[k];
+    if (tagKind(tag) == CELL_EMPTY) return "";
+    if (tagKind(tag) == CELL_TEXT) return scenario.texts[scenario.values[k]];
+    if (tagError(tag) == CELL_NAN) return "#NAN";
+    if (tagError(tag) == CELL_ERROR) return "#ERROR";
+    return to_string(scenario.values[k]);
+}
+
+int runScenarios(const Options& options) {
+
+    /* The base sheet is calculated once, from a text file or a snapshot (which already holds it calculated) */
+
+    LiveSheet live;
+    if (isSnapshotFile(options.inputFileName)) {
+        if (!loadSnapshot(options.inputFileName, live)) {
+            cerr << "Could not read the snapshot " << options.inputFileName << endl;
+            return 1;
+        }
+    }
+    else {
+        SpreadsheetData data = getDataFromSpreadsheet(options.inputFileName, options.threadCount);
+        live = openLiveSheet(separateRows(data, options.threadCount), options.threadCount);
+    }
+    if (live.referencedBy.start.empty()) buildReverseIndex(live);
+    shared_ptr<const LiveSheet> base = make_shared<LiveSheet>(move(live));
+
+    /* Every line of the scenario file is one scenario - its name, then the cells it sets, like B2=150 or C4=text (B2= empties B2), separated by tabs */
+
+    ifstream file(options.scenarioFileName);
+    if (!file) {
+        cerr << "Could not read the scenarios " << options.scenarioFileName << endl;
+        return 1;
+    }
+    vector<string> names;
+    vector<Scenario> scenarios;
+    string line;
+    for (int lineNumber = 1; getline(file, line); lineNumber++) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+
+        size_t end = line.find(delimiter);
+        names.push_back(line.substr(0, end));
+        scenarios.push_back(createScenario(base));
+        while (end != string::npos) {
+            size_t start = end + 1;
+            end = line.find(delimiter, start);
+            string change = line.substr(start, end == string::npos ? string::npos : end - start);
+            if (change.empty()) continue;
+
+            int i = 0, row, column;
+            if (!parseCellIdentifier(change.c_str(), change.size(), i, row, column) || i >= change.size() || change[i] != '='
+                || !setScenarioCell(scenarios.back(), row, column, change.substr(i + 1))) {
+                cerr << "Could not read \"" << change << "\" on line " << lineNumber << " of " << options.scenarioFileName << endl;
+                return 1;
+            }
+        }
+    }
+
+    /* The scenarios are calculated on up to threadCount threads at once. Each one keeps only the printed values of the cells asked for, and lets go of
+        its overlay as soon as it is done, so only threadCount overlays are ever held together */
+
+    vector<string> results(scenarios.size());
+    atomic<int> next(0);
+    auto worker = [&]() {
+        for (int s = next++; s < scenarios.size(); s = next++) {
+            string& result = results[s];
+            result = names[s];
+            for (int k = 0; k < options.queryCells.size(); k++) {
+                result += delimiter;
+                result += getScenarioValue(scenarios[s], options.queryCells[k].row, options.queryCells[k].column);
+            }
+            scenarios[s] = Scenario();
+        }
+    };
+    vector<thread> workers;
+    for (int t = 1; t < min(options.threadCount, (int)scenarios.size()); t++) workers.push_back(thread(worker));
+    worker();
+    for (int t = 0; t < workers.size(); t++) workers[t].join();
+
+    /* A table with one row per scenario and one column per cell asked for */
+
+    cout << "Scenario";
+    for (int k = 0; k < options.queryCells.size(); k++) cout << delimiter << cellName(options.queryCells[k].row, options.queryCells[k].column);
+    cout << endl;
+    for (int s = 0; s < results.size(); s++) cout << results[s] << '\n';
+    cout.flush();
+    return 0;
+}
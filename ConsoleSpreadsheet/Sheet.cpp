@@ -0,0 +1,253 @@
+#include "consolespreadsheet.h"
+#include <cstring>
+
+/*
+    The typed sheet. Rather than keeping every cell as a string, each column is stored as a few contiguous arrays: a one byte tag saying what the cell is,
+    an integer value, and (only for columns that contain formulas) the index of the cell's compiled formula. A column that is mostly empty is stored
+    sparsely - only its non-empty cells are kept, along with the row of each one - so a very wide sheet with few cells filled in only pays for those cells. Text loaded from a file is referenced where
+    it sits in the mapped file, and any other text is copied once into a single string shared by the whole sheet. Numbers are converted when the sheet is
+    built, so evaluating a formula never has to turn a string into an integer or back.
+*/
+
+Sheet createSheet(int rowCount, int columnCount) {
+    Sheet sheet;
+    sheet.rowCount = rowCount;
+    sheet.columnCount = columnCount;
+
+    /* Every column starts out sparse with nothing stored in it, so an empty sheet costs nothing no matter how large it is. Cells are added as they are
+        set, and a column that is going to be well filled can be switched to dense storage with makeColumnDense. */
+
+    sheet.columns.resize(columnCount);
+    for (int j = 0; j < columnCount; j++) sheet.columns[j].sparse = true;
+
+    return sheet;
+}
+
+void makeColumnDense(Sheet& sheet, int column) {
+    Column& cells = sheet.columns[column];
+    if (!cells.sparse) return;
+
+    /* Every cell starts out empty. Referencing an empty cell gives #NAN, which is stored in the tag right away. Any cells that were already stored are then
+        moved to their rows. */
+
+    Column dense;
+    dense.tags.assign(sheet.rowCount, makeTag(CELL_EMPTY, CELL_NAN));
+    dense.values.assign(sheet.rowCount, 0);
+    if (!cells.formulas.empty()) dense.formulas.assign(sheet.rowCount, -1);
+
+    for (int k = 0; k < cells.rows.size(); k++) {
+        dense.tags[cells.rows[k]] = cells.tags[k];
+        dense.values[cells.rows[k]] = cells.values[k];
+        if (!cells.formulas.empty()) dense.formulas[cells.rows[k]] = cells.formulas[k];
+    }
+
+    cells = dense;
+}
+
+int storeCell(Column& cells, int row) {
+    if (!cells.sparse) return row;
+
+    /* Cells are almost always added in increasing row order (that is how a file is read), so the new row can usually just go on the end. Otherwise it is
+        inserted in order, moving the cells below it down by one. */
+
+    int k = cells.rows.size();
+    if (k > 0 && cells.rows[k - 1] >= row) {
+        k = lower_bound(cells.rows.begin(), cells.rows.end(), row) - cells.rows.begin();
+        if (cells.rows[k] == row) return k;
+    }
+
+    cells.rows.insert(cells.rows.begin() + k, row);
+    cells.tags.insert(cells.tags.begin() + k, makeTag(CELL_EMPTY, CELL_NAN));
+    cells.values.insert(cells.values.begin() + k, 0);
+    if (!cells.formulas.empty()) cells.formulas.insert(cells.formulas.begin() + k, -1);
+    return k;
+}
+
+void setCellContents(Sheet& sheet, int row, int column, const char* s, int length) {
+    if (length <= 0) return;
+
+    Column& cells = sheet.columns[column];
+    int k = storeCell(cells, row);
+
+    if (s[0] == '=') {
+
+        /* A formula is compiled as soon as it is stored. Its tag says #NAN until it has been evaluated. */
+
+        CompiledFormulas& program = sheet.formulas;
+        int depth = compileFormula(s, length, sheet.rowCount, sheet.columnCount, program);
+        if (depth > program.maxStackDepth) program.maxStackDepth = depth;
+
+        if (cells.formulas.empty()) cells.formulas.assign(cells.tags.size(), -1);
+        cells.formulas[k] = program.row.size();
+        cells.tags[k] = makeTag(CELL_FORMULA, CELL_NAN);
+
+        program.row.push_back(row);
+        program.column.push_back(column);
+        program.codeStart.push_back(program.code.size());
+        program.group.push_back(-1);
+    }
+    else if (parseNumber(s, length, cells.values[k])) {
+        cells.tags[k] = makeTag(CELL_NUMBER, CELL_OK);
+        if (!isCanonicalNumber(s, length)) cells.numberTexts[row] = internText(sheet, s, length);    // 007 is worth 7, but is written back as 007
+    }
+    else {
+
+        /* Anything else is text. It is written out unchanged, but referencing it from a formula gives #NAN */
+
+        cells.values[k] = internText(sheet, s, length);
+        cells.tags[k] = makeTag(CELL_TEXT, CELL_NAN);
+    }
+}
+
+unsigned long long hashText(const char* s, int length) {
+
+    /* FNV-1a - text cells are mostly short labels, for which this is about as fast as a hash can be */
+
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < length; i++) hash = (hash ^ (unsigned char)s[i]) * 1099511628211ULL;
+    return hash;
+}
+
+int internText(Sheet& sheet, const char* s, int length) {
+
+    /* Sheets tend to repeat the same few labels (a currency, a category, a status) down whole columns, so every different text is kept only once and all
+        of the cells holding it share its TextSpan - and a text typed into a live sheet again and again is not copied into sheet.text again and again.
+        textTable is a hash table of indices into sheet.texts (-1 for an empty slot), kept at most half full so that a lookup only probes a slot or two. It
+        is rebuilt, twice as large, whenever it fills up - which includes the first text stored after a snapshot is loaded, since snapshots do not save it. */
+
+    vector<int>& table = sheet.textTable;
+    if (table.size() < 2 * (sheet.texts.size() + 1)) {
+        size_t size = 16;
+        while (size < 4 * (sheet.texts.size() + 1)) size *= 2;
+        table.assign(size, -1);
+
+        for (int t = 0; t < sheet.texts.size(); t++) {
+            size_t slot = hashText(textData(sheet, sheet.texts[t]), sheet.texts[t].length) & (size - 1);
+            while (table[slot] >= 0) slot = (slot + 1) & (size - 1);
+            table[slot] = t;
+        }
+    }
+
+    size_t mask = table.size() - 1;
+    size_t slot = hashText(s, length) & mask;
+    for (; table[slot] >= 0; slot = (slot + 1) & mask) {
+        const TextSpan& span = sheet.texts[table[slot]];
+        if (span.length == length && memcmp(textData(sheet, span), s, length) == 0) return table[slot];
+    }
+
+    /* Text loaded from a file is not copied at all - the span just points at it within the mapped file */
+
+    TextSpan span;
+    span.length = length;
+    span.inSource = sheet.source && s >= sheet.source->data && s + length <= sheet.source->data + sheet.source->size;
+    if (span.inSource) span.offset = s - sheet.source->data;
+    else {
+        span.offset = sheet.text.size();
+        sheet.text.append(s, length);
+    }
+    table[slot] = sheet.texts.size();
+    sheet.texts.push_back(span);
+    return table[slot];
+}
+
+const char* textData(const Sheet& sheet, const TextSpan& span) {
+    if (span.inSource) return sheet.source->data + span.offset;
+    return sheet.text.data() + span.offset;
+}
+
+int formulaAt(const Sheet& sheet, int row, int column) {
+    const Column& cells = sheet.columns[column];
+    if (cells.formulas.empty()) return -1;
+
+    int k = cellIndex(cells, row);
+    if (k < 0) return -1;
+    return cells.formulas[k];
+}
+
+RowIndex buildRowIndex(const Sheet& sheet, int firstRow, int endRow) {
+    RowIndex index;
+    index.firstRow = firstRow;
+    int rowCount = endRow - firstRow;
+
+    /* A counting sort of the stored cells by row. The first pass counts the non-empty cells of every row, the second places each cell after the ones before
+        it in its row - and because the columns are visited in order, the cells of a row end up in column order. Only cells that hold something are looked at
+        in the sparse columns, so this costs time in proportion to the filled cells rather than to rows x columns. */
+
+    vector<int> first(sheet.columnCount), end(sheet.columnCount);
+    for (int j = 0; j < sheet.columnCount; j++) {
+        const Column& cells = sheet.columns[j];
+        first[j] = cells.sparse ? lower_bound(cells.rows.begin(), cells.rows.end(), firstRow) - cells.rows.begin() : firstRow;
+        end[j] = cells.sparse ? lower_bound(cells.rows.begin(), cells.rows.end(), endRow) - cells.rows.begin() : endRow;
+    }
+
+    index.rowStart.assign(rowCount + 1, 0);
+    for (int j = 0; j < sheet.columnCount; j++) {
+        const Column& cells = sheet.columns[j];
+        for (int k = first[j]; k < end[j]; k++) {
+            if (tagKind(cells.tags[k]) != CELL_EMPTY) index.rowStart[storedRow(cells, k) - firstRow + 1]++;
+        }
+    }
+    for (int i = 0; i < rowCount; i++) index.rowStart[i + 1] += index.rowStart[i];
+
+    vector<long long> next(index.rowStart.begin(), index.rowStart.end() - 1);
+    index.column.resize(index.rowStart[rowCount]);
+    index.index.resize(index.rowStart[rowCount]);
+
+    for (int j = 0; j < sheet.columnCount; j++) {
+        const Column& cells = sheet.columns[j];
+        for (int k = first[j]; k < end[j]; k++) {
+            if (tagKind(cells.tags[k]) == CELL_EMPTY) continue;
+            long long position = next[storedRow(cells, k) - firstRow]++;
+            index.column[position] = j;
+            index.index[position] = k;
+        }
+    }
+
+    return index;
+}
+
+void clearCell(Sheet& sheet, int row, int column) {
+    Column& cells = sheet.columns[column];
+    int k = cellIndex(cells, row);
+    if (k < 0) return;
+
+    /* A formula that is cleared keeps its compiled code (other formulas' indices must not change), but is marked as removed so it is never evaluated again.
+        It also leaves its group, although the group's code stays in place for the rest of its formulas */
+
+    if (!cells.formulas.empty() && cells.formulas[k] >= 0) {
+        sheet.formulas.row[cells.formulas[k]] = -1;
+        sheet.formulas.group[cells.formulas[k]] = -1;
+        cells.formulas[k] = -1;
+    }
+    cells.tags[k] = makeTag(CELL_EMPTY, CELL_NAN);
+    cells.values[k] = 0;
+    if (!cells.numberTexts.empty()) cells.numberTexts.erase(row);
+}
+
+string cellName(int row, int column) {
+
+    /* The reverse of parseCellIdentifier - columns are numbered A .. Z, AA .. AZ, BA .. and so on */
+
+    string name;
+    for (column++; column > 0; column = (column - 1) / 26) name.insert(name.begin(), (char)('A' + (column - 1) % 26));
+    return name + to_string(row + 1);
+}
+
+string formatCell(const Sheet& sheet, int row, int column) {
+    const Column& cells = sheet.columns[column];
+    int k = cellIndex(cells, row);
+    if (k < 0 || tagKind(cells.tags[k]) == CELL_EMPTY) return "";
+
+    unsigned char tag = cells.tags[k];
+    if (tagKind(tag) == CELL_TEXT) {
+        const TextSpan& span = sheet.texts[cells.values[k]];
+        return string(textData(sheet, span), span.length);
+    }
+    if (tagError(tag) == CELL_NAN) return "#NAN";
+    if (tagError(tag) == CELL_ERROR) return "#ERROR";
+    if (tagKind(tag) == CELL_NUMBER && !cells.numberTexts.empty()) {
+        unordered_map<int, int>::const_iterator text = cells.numberTexts.find(row);
+        if (text != cells.numberTexts.end()) return string(textData(sheet, sheet.texts[text->second]), sheet.texts[text->second].length);
+    }
+    return to_string(cells.values[k]);
+}
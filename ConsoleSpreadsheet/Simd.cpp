@@ -0,0 +1,234 @@
+#include "consolespreadsheet.h"
+#include <cstring>
+
+/*
+    The arithmetic the formula group kernel does on whole blocks of values. Every x86-64 processor has SSE2, which works on 2 integers at a time, and most
+    recent ones also have AVX2, which works on 4 - but a program built to require AVX2 would not run at all on the ones without it. So the AVX2 versions
+    are compiled on their own (with the target attribute on GCC and Clang, MSVC allows the instructions anywhere) and only called after checking the
+    processor once at run time. On any other processor the plain loops are used.
+
+    Reading the numbers of a sheet works the same way - every cell is checked for digits with SSE2, and converted with SSE4.1 when the processor has it.
+*/
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#define TARGET_SSE41
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#endif
+#endif
+
+bool cpuSupportsAvx2() {
+#if defined(USE_SSE2) && defined(_MSC_VER)
+
+    /* AVX2 is bit 5 of EBX for CPUID leaf 7. The processor having it is not enough - the operating system also has to save the 256 bit registers when it
+        switches threads, which is what OSXSAVE and XGETBV say */
+
+    static const bool supported = []() {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return false;
+        __cpuid(info, 1);
+        if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;
+        if ((_xgetbv(0) & 6) != 6) return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    }();
+    return supported;
+#elif defined(USE_SSE2)
+    static const bool supported = __builtin_cpu_supports("avx2") != 0;
+    return supported;
+#else
+    return false;
+#endif
+}
+
+bool cpuSupportsSse41() {
+#if defined(USE_SSE2) && defined(_MSC_VER)
+
+    /* SSE4.1 is bit 19 of ECX for CPUID leaf 1 (SSSE3, which comes before it, is bit 9) */
+
+    static const bool supported = []() {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 19)) != 0 && (info[2] & (1 << 9)) != 0;
+    }();
+    return supported;
+#elif defined(USE_SSE2)
+    static const bool supported = __builtin_cpu_supports("sse4.1") != 0;
+    return supported;
+#else
+    return false;
+#endif
+}
+
+#ifdef USE_SSE2
+
+TARGET_AVX2 static void addVectorsAvx2(long long* a, const long long* b, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        _mm256_storeu_si256((__m256i*)(a + i), _mm256_add_epi64(x, y));
+    }
+    for (; i < count; i++) a[i] = wrapAdd(a[i], b[i]);
+}
+
+TARGET_AVX2 static void subtractVectorsAvx2(long long* a, const long long* b, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        _mm256_storeu_si256((__m256i*)(a + i), _mm256_sub_epi64(x, y));
+    }
+    for (; i < count; i++) a[i] = wrapSubtract(a[i], b[i]);
+}
+
+TARGET_AVX2 static void mergeTagErrorsAvx2(unsigned char* errors, const unsigned char* tags, int count) {
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i tag = _mm256_loadu_si256((const __m256i*)(tags + i));
+        __m256i error = _mm256_and_si256(_mm256_srli_epi16(tag, 4), low);
+        __m256i current = _mm256_loadu_si256((const __m256i*)(errors + i));
+        _mm256_storeu_si256((__m256i*)(errors + i), _mm256_max_epu8(current, error));
+    }
+    for (; i < count; i++) {
+        unsigned char error = tags[i] >> 4;
+        if (error > errors[i]) errors[i] = error;
+    }
+}
+
+TARGET_SSE41 static long long parseDigitsSse41(__m128i digits) {
+
+    /* Turns 16 digits (already checked, and less '0') into their value in three steps, each joining neighbouring numbers into one with twice as many
+        digits: pairs of digits times (10, 1), pairs of those times (100, 1), and pairs of those times (10000, 1). That leaves two 8 digit halves */
+
+    __m128i pairs = _mm_maddubs_epi16(digits, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+    __m128i packed = _mm_packus_epi32(quads, quads);
+    __m128i halves = _mm_madd_epi16(packed, _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+    return (long long)(unsigned)_mm_cvtsi128_si32(halves) * 100000000 + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(halves, 4));
+}
+
+#endif
+
+bool parseNumber(const char* s, int length, long long& value) {
+    value = 0;
+
+    /* A leading '-' is taken off first, so the digits are read the same way for negative numbers */
+
+    bool negative = length > 1 && s[0] == '-';
+    if (negative) {
+        s++;
+        length--;
+    }
+
+#ifdef USE_SSE2
+
+    /* Almost every number in a sheet is well under 16 digits, so the digits are right aligned in a block of 16 (padded with leading zeros - the cell itself
+        may end right at the end of the mapped file, so there is nothing to read past it) and checked all at once: less '0', a digit is 0 .. 9 and anything
+        else is out of range. With SSE4.1 the whole block is then converted together as well. Longer numbers go through the plain loop */
+
+    if (length <= 16) {
+        char block[16];
+        memset(block, '0', 16);
+        memcpy(block + 16 - length, s, length);
+
+        __m128i digits = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)block), _mm_set1_epi8('0'));
+        __m128i invalid = _mm_or_si128(_mm_cmplt_epi8(digits, _mm_setzero_si128()), _mm_cmpgt_epi8(digits, _mm_set1_epi8(9)));
+        if (_mm_movemask_epi8(invalid) != 0) return false;
+
+        if (cpuSupportsSse41()) value = parseDigitsSse41(digits);
+        else {
+            int i = 0;
+            value = parseInteger(s, length, i);
+        }
+        if (negative) value = -value;
+        return true;
+    }
+#endif
+
+    /* Longer numbers are read one digit at a time. A number that does not fit in 64 bits is not one the sheet can hold, so it stays text (and referencing
+        it gives #NAN) rather than losing digits */
+
+    unsigned long long limit = negative ? 9223372036854775808ULL : LLONG_MAX, magnitude = 0;
+    for (int i = 0; i < length; i++) {
+        if (!isdigit(s[i])) return false;
+        unsigned digit = s[i] - '0';
+        if (magnitude > (limit - digit) / 10) return false;
+        magnitude = magnitude * 10 + digit;
+    }
+    value = negative ? (long long)(0 - magnitude) : (long long)magnitude;
+    return true;
+}
+
+void addVectors(long long* a, const long long* b, int count) {
+    int i = 0;
+#ifdef USE_SSE2
+    if (cpuSupportsAvx2()) {
+        addVectorsAvx2(a, b, count);
+        return;
+    }
+    for (; i + 2 <= count; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        _mm_storeu_si128((__m128i*)(a + i), _mm_add_epi64(x, y));
+    }
+#endif
+    for (; i < count; i++) a[i] = wrapAdd(a[i], b[i]);
+}
+
+void subtractVectors(long long* a, const long long* b, int count) {
+    int i = 0;
+#ifdef USE_SSE2
+    if (cpuSupportsAvx2()) {
+        subtractVectorsAvx2(a, b, count);
+        return;
+    }
+    for (; i + 2 <= count; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        _mm_storeu_si128((__m128i*)(a + i), _mm_sub_epi64(x, y));
+    }
+#endif
+    for (; i < count; i++) a[i] = wrapSubtract(a[i], b[i]);
+}
+
+void multiplyVectors(long long* a, const long long* b, int count) {
+
+    /* Neither SSE2 nor AVX2 can multiply 64 bit integers (that needs AVX-512), so this is a plain loop - still much faster than interpreting one cell at
+        a time, since it runs straight through the block */
+
+    for (int i = 0; i < count; i++) a[i] = wrapMultiply(a[i], b[i]);
+}
+
+void mergeTagErrors(unsigned char* errors, const unsigned char* tags, int count) {
+
+    /* The error of a cell is the high 4 bits of its tag (see makeTag), so every byte is shifted down by 4 and the larger of the two errors is kept. SSE2
+        can only shift 16 bit values, which pulls bits of the next byte into the top of each byte - the mask clears them again. */
+
+    int i = 0;
+#ifdef USE_SSE2
+    if (cpuSupportsAvx2()) {
+        mergeTagErrorsAvx2(errors, tags, count);
+        return;
+    }
+    const __m128i low = _mm_set1_epi8(0x0F);
+    for (; i + 16 <= count; i += 16) {
+        __m128i tag = _mm_loadu_si128((const __m128i*)(tags + i));
+        __m128i error = _mm_and_si128(_mm_srli_epi16(tag, 4), low);
+        __m128i current = _mm_loadu_si128((const __m128i*)(errors + i));
+        _mm_storeu_si128((__m128i*)(errors + i), _mm_max_epu8(current, error));
+    }
+#endif
+    for (; i < count; i++) {
+        unsigned char error = tags[i] >> 4;
+        if (error > errors[i]) errors[i] = error;
+    }
+}
@@ -0,0 +1,353 @@
+#include "consolespreadsheet.h"
+#include <cstring>
+#include <cstdint>
+
+/*
+    Snapshots. Loading a large sheet from text means tokenizing every cell, converting every number, compiling every formula, building the dependency graph
+    and evaluating everything - all before a single row can be written. A snapshot stores the result of all of that: the typed columns, the compiled
+    formulas, the range trees, the dependency graph and the evaluation order, each as a flat array exactly as it sits in memory. Loading one is just mapping
+    the file: the arrays of the columns and the formulas (MappedArray) are used right where they sit in it, and the text cells stay in it too, so nothing is
+    copied and the operating system only reads the pages that are actually used. The rest - the arrays of structs and the graph - is copied out in one go.
+    The file is mapped copy-on-write, so evaluating and editing the sheet can write to the arrays in place without ever changing the file.
+
+    The file is a SnapshotHeader followed by the arrays one after another. Every array is its element count (8 bytes) followed by the elements, padded with
+    zeros to a multiple of 8 bytes. Structs are split into one array per field, so nothing depends on how the compiler lays a struct out, and the same sheet
+    always gives exactly the same file.
+*/
+
+template <class T> static void writeArray(ofstream& out, const T* data, long long count) {
+    out.write((const char*)&count, sizeof(count));
+    if (count > 0) out.write((const char*)data, count * sizeof(T));
+
+    static const char padding[8] = { 0 };
+    long long size = count * sizeof(T);
+    if (size % 8 != 0) out.write(padding, 8 - size % 8);
+}
+
+template <class T> static void writeArray(ofstream& out, const vector<T>& values) {
+    writeArray(out, values.data(), values.size());
+}
+
+template <class T> static void writeArray(ofstream& out, const MappedArray<T>& values) {
+    writeArray(out, values.data(), values.size());
+}
+
+/* Where reading a snapshot has got to. ok is cleared as soon as anything does not fit in the file, and every read after that does nothing */
+struct SnapshotReader {
+    const char* data;
+    long long size;
+    long long position;
+    bool ok;
+};
+
+/* Moves the reader past the next array, returning where its elements are in the file (nullptr if it does not fit) and how many there are in count */
+static const char* nextArray(SnapshotReader& reader, long long elementSize, long long& count) {
+    count = 0;
+    if (!reader.ok || reader.size - reader.position < (long long)sizeof(count)) {
+        reader.ok = false;
+        return nullptr;
+    }
+    memcpy(&count, reader.data + reader.position, sizeof(count));
+    reader.position += sizeof(count);
+
+    if (count < 0 || count > reader.size / elementSize || reader.size - reader.position < (count * elementSize + 7) / 8 * 8) {
+        reader.ok = false;
+        count = 0;
+        return nullptr;
+    }
+
+    const char* elements = reader.data + reader.position;
+    reader.position += (count * elementSize + 7) / 8 * 8;
+    return elements;
+}
+
+template <class T> static void readArray(SnapshotReader& reader, vector<T>& values) {
+    long long count;
+    const char* elements = nextArray(reader, sizeof(T), count);
+    values.resize(count);
+    if (count > 0) memcpy(values.data(), elements, count * sizeof(T));
+}
+
+template <class T> static void readArray(SnapshotReader& reader, MappedArray<T>& values) {
+
+    /* The elements are used right where they are in the mapped file. Every array starts a multiple of 8 bytes into the file, so they are always aligned -
+        but should one not be, it is copied rather than read unaligned */
+
+    long long count;
+    const char* elements = nextArray(reader, sizeof(T), count);
+    if (count > 0 && (uintptr_t)elements % alignof(T) == 0) values.view((T*)const_cast<char*>(elements), count);
+    else {
+        values.resize(count);
+        if (count > 0) memcpy(values.data(), elements, count * sizeof(T));
+    }
+}
+
+bool saveSnapshot(const LiveSheet& live, const string& fileName) {
+    ofstream out(fileName, ios::binary);
+    if (!out) return false;
+
+    const Sheet& sheet = live.sheet;
+    SnapshotHeader header;
+    memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.version = snapshotVersion;
+    header.byteOrder = 0x01020304;
+    header.rowCount = sheet.rowCount;
+    header.columnCount = sheet.columnCount;
+    out.write((const char*)&header, sizeof(header));
+
+    /* The columns */
+
+    vector<char> sparse(sheet.columnCount);
+    for (int j = 0; j < sheet.columnCount; j++) sparse[j] = sheet.columns[j].sparse;
+    writeArray(out, sparse);
+    for (int j = 0; j < sheet.columnCount; j++) {
+        const Column& column = sheet.columns[j];
+        writeArray(out, column.rows);
+        writeArray(out, column.tags);
+        writeArray(out, column.values);
+        writeArray(out, column.formulas);
+
+        /* The number cells that keep their own text, in the order of their rows (the order of the map is not the same from one run to the next) */
+
+        vector<pair<int, int>> texts(column.numberTexts.begin(), column.numberTexts.end());
+        sort(texts.begin(), texts.end());
+        vector<int> numberRows(texts.size()), numberTexts(texts.size());
+        for (int k = 0; k < texts.size(); k++) {
+            numberRows[k] = texts[k].first;
+            numberTexts[k] = texts[k].second;
+        }
+        writeArray(out, numberRows);
+        writeArray(out, numberTexts);
+    }
+
+    /* The text cells. Wherever their text was before (the input file or sheet.text), it is all gathered into one block, and the offsets are relative to
+        the start of that block */
+
+    vector<long long> textOffsets(sheet.texts.size());
+    vector<int> textLengths(sheet.texts.size());
+    string text;
+    for (int k = 0; k < sheet.texts.size(); k++) {
+        textOffsets[k] = text.size();
+        textLengths[k] = sheet.texts[k].length;
+        text.append(textData(sheet, sheet.texts[k]), sheet.texts[k].length);
+    }
+    writeArray(out, textOffsets);
+    writeArray(out, textLengths);
+    writeArray(out, text.data(), text.size());
+
+    /* The compiled formulas */
+
+    const CompiledFormulas& program = sheet.formulas;
+    vector<unsigned char> ops(program.code.size());
+    vector<int> codeRows(program.code.size()), codeColumns(program.code.size());
+    for (int k = 0; k < program.code.size(); k++) {
+        ops[k] = program.code[k].op;
+        codeRows[k] = program.code[k].row;
+        codeColumns[k] = program.code[k].column;
+    }
+
+    vector<int> ranges;
+    for (int k = 0; k < program.ranges.size(); k++) {
+        const CellRange& range = program.ranges[k];
+        int fields[] = { range.firstRow, range.lastRow, range.firstColumn, range.lastColumn };
+        ranges.insert(ranges.end(), fields, fields + 4);
+    }
+
+    vector<int> groups;
+    for (int g = 0; g < program.groups.size(); g++) {
+        const FormulaGroup& group = program.groups[g];
+        int fields[] = { group.column, group.firstRow, group.rowCount, group.codeStart, group.codeEnd };
+        groups.insert(groups.end(), fields, fields + 5);
+    }
+
+    writeArray(out, program.row);
+    writeArray(out, program.column);
+    writeArray(out, ops);
+    writeArray(out, codeRows);
+    writeArray(out, codeColumns);
+    writeArray(out, program.constants);
+    writeArray(out, ranges);
+    writeArray(out, program.codeStart);
+    writeArray(out, program.group);
+    writeArray(out, groups);
+    writeArray(out, &program.maxStackDepth, 1);
+
+    /* The range trees */
+
+    const RangeIndex& index = sheet.rangeIndex;
+    int summaryCount = index.summaries.size();
+    vector<long long> sums(summaryCount), mins(summaryCount), maxs(summaryCount), counts(summaryCount);
+    vector<unsigned char> errors(summaryCount);
+    for (int k = 0; k < summaryCount; k++) {
+        sums[k] = index.summaries[k].sum;
+        mins[k] = index.summaries[k].min;
+        maxs[k] = index.summaries[k].max;
+        counts[k] = index.summaries[k].count;
+        errors[k] = index.summaries[k].error;
+    }
+
+    writeArray(out, &index.leafCount, 1);
+    writeArray(out, index.treeOf);
+    writeArray(out, index.columnOf);
+    writeArray(out, sums);
+    writeArray(out, mins);
+    writeArray(out, maxs);
+    writeArray(out, counts);
+    writeArray(out, errors);
+
+    /* The dependency graph and the order the formulas are evaluated in */
+
+    writeArray(out, live.graph.referenceStart);
+    writeArray(out, live.graph.references);
+    writeArray(out, live.order);
+    writeArray(out, live.circular);
+
+    /* The hashes of the input rows, for a snapshot kept as a result cache (see Cache.cpp) - empty otherwise */
+
+    writeArray(out, live.rowHashes);
+
+    out.close();
+    return !out.fail();
+}
+
+bool loadSnapshot(const string& fileName, LiveSheet& live) {
+    shared_ptr<MappedFile> file = mapFileCopyOnWrite(fileName);
+    if (!file || file->size < (long long)sizeof(SnapshotHeader)) return false;
+
+    SnapshotHeader header;
+    memcpy(&header, file->data, sizeof(header));
+    if (memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 || header.version != snapshotVersion || header.byteOrder != 0x01020304) return false;
+    if (header.rowCount < 0 || header.columnCount < 0) return false;
+
+    SnapshotReader reader = { file->data, file->size, (long long)sizeof(header), true };
+    Sheet& sheet = live.sheet;
+    sheet = createSheet(header.rowCount, header.columnCount);
+    sheet.source = file;
+
+    /* The columns */
+
+    vector<char> sparse;
+    readArray(reader, sparse);
+    if (sparse.size() != sheet.columnCount) return false;
+    vector<vector<int>> numberRows(sheet.columnCount), numberTexts(sheet.columnCount);
+    for (int j = 0; j < sheet.columnCount && reader.ok; j++) {
+        Column& column = sheet.columns[j];
+        column.sparse = sparse[j] != 0;
+        readArray(reader, column.rows);
+        readArray(reader, column.tags);
+        readArray(reader, column.values);
+        readArray(reader, column.formulas);
+        readArray(reader, numberRows[j]);
+        readArray(reader, numberTexts[j]);
+
+        /* Only the sizes are checked - a snapshot is trusted to have been written by saveSnapshot */
+
+        long long stored = column.sparse ? column.rows.size() : sheet.rowCount;
+        if (column.tags.size() != stored || column.values.size() != stored || (!column.formulas.empty() && column.formulas.size() != stored)) return false;
+        if (numberRows[j].size() != numberTexts[j].size()) return false;
+    }
+
+    /* The text cells are pointed at where their text sits in the snapshot, which stays mapped for as long as the sheet is around */
+
+    vector<long long> textOffsets;
+    vector<int> textLengths;
+    readArray(reader, textOffsets);
+    readArray(reader, textLengths);
+    long long textLength;
+    const char* text = nextArray(reader, 1, textLength);
+    if (!reader.ok || textOffsets.size() != textLengths.size()) return false;
+
+    sheet.texts.resize(textOffsets.size());
+    for (int k = 0; k < sheet.texts.size(); k++) {
+        if (textOffsets[k] < 0 || textLengths[k] < 0 || textOffsets[k] + textLengths[k] > textLength) return false;
+        sheet.texts[k].offset = (text - file->data) + textOffsets[k];
+        sheet.texts[k].length = textLengths[k];
+        sheet.texts[k].inSource = true;
+    }
+
+    /* The number cells that keep their own text point at it only now that the texts are in place */
+
+    for (int j = 0; j < sheet.columnCount; j++) {
+        for (int k = 0; k < numberRows[j].size(); k++) {
+            if (numberTexts[j][k] < 0 || numberTexts[j][k] >= sheet.texts.size()) return false;
+            sheet.columns[j].numberTexts[numberRows[j][k]] = numberTexts[j][k];
+        }
+    }
+
+    /* The compiled formulas */
+
+    CompiledFormulas& program = sheet.formulas;
+    vector<unsigned char> ops;
+    vector<int> codeRows, codeColumns, ranges, groups, maxStackDepth;
+    readArray(reader, program.row);
+    readArray(reader, program.column);
+    readArray(reader, ops);
+    readArray(reader, codeRows);
+    readArray(reader, codeColumns);
+    readArray(reader, program.constants);
+    readArray(reader, ranges);
+    readArray(reader, program.codeStart);
+    readArray(reader, program.group);
+    readArray(reader, groups);
+    readArray(reader, maxStackDepth);
+    if (!reader.ok || codeRows.size() != ops.size() || codeColumns.size() != ops.size() || maxStackDepth.size() != 1) return false;
+    if (program.column.size() != program.row.size() || program.group.size() != program.row.size() || program.codeStart.size() != program.row.size() + 1) return false;
+
+    program.code.resize(ops.size());
+    for (int k = 0; k < ops.size(); k++) program.code[k] = { (OpCode)ops[k], codeRows[k], codeColumns[k] };
+    program.ranges.resize(ranges.size() / 4);
+    for (int k = 0; k < program.ranges.size(); k++) program.ranges[k] = { ranges[4 * k], ranges[4 * k + 1], ranges[4 * k + 2], ranges[4 * k + 3] };
+    program.groups.resize(groups.size() / 5);
+    for (int g = 0; g < program.groups.size(); g++) program.groups[g] = { groups[5 * g], groups[5 * g + 1], groups[5 * g + 2], groups[5 * g + 3], groups[5 * g + 4] };
+    program.maxStackDepth = maxStackDepth[0];
+
+    /* The range trees */
+
+    RangeIndex& index = sheet.rangeIndex;
+    vector<int> leafCount;
+    vector<long long> sums, mins, maxs, counts;
+    vector<unsigned char> errors;
+    readArray(reader, leafCount);
+    readArray(reader, index.treeOf);
+    readArray(reader, index.columnOf);
+    readArray(reader, sums);
+    readArray(reader, mins);
+    readArray(reader, maxs);
+    readArray(reader, counts);
+    readArray(reader, errors);
+    if (!reader.ok || leafCount.size() != 1) return false;
+
+    index.leafCount = leafCount[0];
+    index.summaries.resize(sums.size());
+    for (int k = 0; k < index.summaries.size(); k++) {
+        index.summaries[k].sum = sums[k];
+        index.summaries[k].min = mins[k];
+        index.summaries[k].max = maxs[k];
+        index.summaries[k].count = counts[k];
+        index.summaries[k].error = (CellError)errors[k];
+    }
+
+    /* The dependency graph and evaluation order. The positions in the order are cheap to work out again, and the reverse edges are built when they are
+        first needed, just like for a sheet loaded from text */
+
+    readArray(reader, live.graph.referenceStart);
+    readArray(reader, live.graph.references);
+    readArray(reader, live.order);
+    readArray(reader, live.circular);
+    readArray(reader, live.rowHashes);
+    if (!reader.ok || live.graph.referenceStart.size() != live.order.size() + 1 || live.circular.size() != live.order.size()) return false;
+
+    live.position.assign(live.order.size(), 0);
+    for (int i = 0; i < live.order.size(); i++) live.position[live.order[i]] = i;
+    live.referencedBy = ReverseIndex();
+    live.changedCells.clear();
+    live.structureChanged = false;
+    return true;
+}
+
+bool isSnapshotFile(const string& fileName) {
+    ifstream in(fileName, ios::binary);
+    char magic[sizeof(snapshotMagic)];
+    if (!in.read(magic, sizeof(magic))) return false;
+    return memcmp(magic, snapshotMagic, sizeof(magic)) == 0;
+}
@@ -0,0 +1,133 @@
+#include "consolespreadsheet.h"
+#include <cstdlib>
+#include <new>
+
+/*
+    The statistics printed by --stats. Counting costs something, so nothing is counted unless statisticsEnabled is set: the evaluation loops check it once
+    per range of formulas and the range functions once per lookup, so a normal run pays for an untaken branch now and then and nothing more. With it set,
+    every formula is also timed on its own, which slows evaluation down a few times but shows exactly which cells the time goes to.
+*/
+
+bool statisticsEnabled = false;
+Statistics statistics;
+
+/* Every allocation goes through here, so that the allocations can be counted. Without --stats this is just malloc */
+
+void* operator new(size_t size) {
+    if (statisticsEnabled) {
+        statistics.counters[COUNTER_ALLOCATIONS].fetch_add(1, memory_order_relaxed);
+        statistics.counters[COUNTER_ALLOCATED_BYTES].fetch_add(size, memory_order_relaxed);
+    }
+    void* memory = malloc(size > 0 ? size : 1);
+    if (memory == NULL) throw bad_alloc();
+    return memory;
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void prepareStatistics(int nodeCount) {
+    if (statistics.formulaSeconds.size() < nodeCount) {
+        statistics.formulaSeconds.resize(nodeCount, 0);
+        statistics.formulaEvaluations.resize(nodeCount, 0);
+    }
+}
+
+void countEvaluation(const Sheet& sheet, int node, bool circular, double seconds) {
+    const CompiledFormulas& program = sheet.formulas;
+    statistics.formulaSeconds[node] += seconds;
+    statistics.formulaEvaluations[node]++;
+
+    if (node >= program.row.size()) statistics.counters[COUNTER_RANGE_NODES].fetch_add(1, memory_order_relaxed);
+    else if (circular) statistics.counters[COUNTER_CIRCULAR].fetch_add(1, memory_order_relaxed);
+    else if (program.row[node] >= 0) {
+        FormulaCode code = formulaCode(program, node);
+        statistics.counters[COUNTER_FORMULAS].fetch_add(1, memory_order_relaxed);
+        statistics.counters[COUNTER_INSTRUCTIONS].fetch_add(code.end - code.begin, memory_order_relaxed);
+    }
+}
+
+void countGroupBlock(const Sheet& sheet, const vector<int>& formulas, int first, int rowCount, double seconds) {
+
+    /* The kernel works on the whole block at once, so each row is given an equal share of its time */
+
+    const CompiledFormulas& program = sheet.formulas;
+    const FormulaGroup& group = program.groups[program.group[formulas[first]]];
+    for (int r = 0; r < rowCount; r++) {
+        statistics.formulaSeconds[formulas[first + r]] += seconds / rowCount;
+        statistics.formulaEvaluations[formulas[first + r]]++;
+    }
+    statistics.counters[COUNTER_GROUP_ROWS].fetch_add(rowCount, memory_order_relaxed);
+    statistics.counters[COUNTER_GROUP_BLOCKS].fetch_add(1, memory_order_relaxed);
+    statistics.counters[COUNTER_INSTRUCTIONS].fetch_add(group.codeEnd - group.codeStart, memory_order_relaxed);
+}
+
+int dependencyDepth(const DependencyGraph& graph, const vector<int>& order, const vector<char>& circular) {
+
+    /* The longest chain of formulas each waiting on the one before - the same as the number of levels scheduleLevels finds, and the least number of steps
+        evaluation could take with any number of threads. Cells in cycles are left out, they never wait for anything */
+
+    vector<int> depth(graph.referenceStart.size() - 1, 0);
+    int deepest = 0;
+    for (int i = 0; i < order.size(); i++) {
+        int node = order[i];
+        if (circular[node]) continue;
+        for (int k = graph.referenceStart[node]; k < graph.referenceStart[node + 1]; k++) depth[node] = max(depth[node], depth[graph.references[k]]);
+        deepest = max(deepest, ++depth[node]);
+    }
+    return deepest;
+}
+
+void printStatistics(const Sheet& sheet, int topCount) {
+    const CompiledFormulas& program = sheet.formulas;
+    int formulaCount = program.row.size();
+    long long counters[COUNTER_COUNT];
+    for (int c = 0; c < COUNTER_COUNT; c++) counters[c] = statistics.counters[c].load();
+
+    /* Only formulas go in the list of expensive cells - the time of a range node is part of the range functions that read it */
+
+    vector<int> slowest;
+    int mostEvaluations = 0, evaluatedCount = 0;
+    for (int formula = 0; formula < formulaCount && formula < statistics.formulaSeconds.size(); formula++) {
+        if (program.row[formula] < 0) continue;
+        slowest.push_back(formula);
+        if (statistics.formulaEvaluations[formula] > 0) evaluatedCount++;
+        mostEvaluations = max(mostEvaluations, statistics.formulaEvaluations[formula]);
+    }
+    topCount = min(topCount, (int)slowest.size());
+    partial_sort(slowest.begin(), slowest.begin() + topCount, slowest.end(), [](int a, int b) {
+        return statistics.formulaSeconds[a] > statistics.formulaSeconds[b];
+    });
+
+    const PhaseTimes& phases = statistics.phases;
+    cout.precision(9);    // single cells can take well under a microsecond
+    cout << fixed;
+    cout << "{" << endl;
+    cout << "  \"phases\": { \"load\": " << phases.load << ", \"tokenize\": " << phases.tokenize << ", \"evaluate\": " << phases.evaluate << ", \"write\": " << phases.write << " }," << endl;
+    cout << "  \"evaluatePhases\": { \"rangeIndex\": " << statistics.rangeIndexSeconds << ", \"graph\": " << statistics.graphSeconds << ", \"order\": " << statistics.orderSeconds << ", \"cells\": " << statistics.cellSeconds << " }," << endl;
+    cout << "  \"rows\": " << sheet.rowCount << ", \"columns\": " << sheet.columnCount << ", \"formulas\": " << formulaCount << ", \"formulaGroups\": " << program.groups.size() << ", \"rangeNodes\": " << sheet.rangeIndex.summaries.size() << "," << endl;
+    cout << "  \"circularCells\": " << counters[COUNTER_CIRCULAR] << ", \"maxDependencyDepth\": " << statistics.maxDepth << "," << endl;
+    cout << "  \"counters\": { \"formulasEvaluated\": " << counters[COUNTER_FORMULAS] << ", \"groupRowsEvaluated\": " << counters[COUNTER_GROUP_ROWS] << ", \"groupBlocks\": " << counters[COUNTER_GROUP_BLOCKS];
+    cout << ", \"instructions\": " << counters[COUNTER_INSTRUCTIONS] << ", \"rangeNodesUpdated\": " << counters[COUNTER_RANGE_NODES];
+    cout << ", \"rangeNodeHits\": " << counters[COUNTER_RANGE_NODE_HITS] << ", \"rangeCellsRead\": " << counters[COUNTER_RANGE_CELLS];
+    cout << ", \"allocations\": " << counters[COUNTER_ALLOCATIONS] << ", \"allocatedBytes\": " << counters[COUNTER_ALLOCATED_BYTES] << " }," << endl;
+    cout << "  \"evaluationsPerFormula\": { \"mean\": " << (evaluatedCount > 0 ? (double)(counters[COUNTER_FORMULAS] + counters[COUNTER_GROUP_ROWS] + counters[COUNTER_CIRCULAR]) / evaluatedCount : 0);
+    cout << ", \"max\": " << mostEvaluations << " }," << endl;
+    cout << "  \"slowestCells\": [";
+    for (int i = 0; i < topCount; i++) {
+        int formula = slowest[i];
+        cout << (i > 0 ? "," : "") << endl << "    { \"cell\": \"" << cellName(program.row[formula], program.column[formula]) << "\", \"seconds\": " << statistics.formulaSeconds[formula];
+        cout << ", \"evaluations\": " << statistics.formulaEvaluations[formula] << ", \"inGroup\": " << (program.group[formula] >= 0 ? "true" : "false") << " }";
+    }
+    cout << endl << "  ]" << endl;
+    cout << "}" << endl;
+}
@@ -0,0 +1,189 @@
+#include "consolespreadsheet.h"
+#include <cstring>
+#include <unordered_set>
+
+/*
+    Workbooks (--workbook). Related data often lives in several sheets - a summary sheet over a sheet of transactions and a sheet of rates, say - and a
+    formula in one can reference a cell of another as Sheet2!B7 (or a range, as SUM(Sheet2!A1:A100)). Each sheet is its own file, named after the sheet, in
+    the same directory as the first sheet (the input file), which is the one that is written to the output.
+
+    Sheets are only read when something references them: the input file is tokenized first, its formulas are searched for sheet names, and only the sheets
+    named are tokenized in turn, and so on - a sheet no formula reaches is never opened. The sheets found are then loaded side by side into the columns of a
+    single Sheet, with every reference compiled to the columns its sheet went to. From there on the workbook is just one sheet: one dependency graph runs
+    across all of the sheets (so a cycle through several sheets is found like any other), and everything is evaluated together in one pass.
+*/
+
+static void addReferencedSheets(const SpreadsheetData& data, vector<string>& names) {
+
+    /* The name of a sheet is the run of letters, digits and '_' right before a '!' (see parseSheetName). Only formulas are searched, and only for '!' */
+
+    for (long long k = 0; k < data.cells.size(); k++) {
+        const char* s = data.file->data + data.cells[k].offset;
+        const char* end = s + data.cells[k].length;
+        if (s[0] != '=') continue;
+
+        for (const char* mark = (const char*)memchr(s, '!', end - s); mark != NULL; mark = (const char*)memchr(mark + 1, '!', end - mark - 1)) {
+            const char* name = mark;
+            while (name > s && (isalnum((unsigned char)name[-1]) || name[-1] == '_')) name--;
+            if (name < mark) names.push_back(string(name, mark - name));
+        }
+    }
+}
+
+static void padColumn(Column& cells, int rowCount) {
+
+    /* A dense column has every row in place, so one from a sheet with fewer rows than the workbook's longest is filled out with empty cells */
+
+    if (cells.sparse || cells.tags.size() >= rowCount) return;
+    cells.tags.resize(rowCount, makeTag(CELL_EMPTY, CELL_NAN));
+    cells.values.resize(rowCount, 0);
+    if (!cells.formulas.empty()) cells.formulas.resize(rowCount, -1);
+}
+
+static void appendFormulas(CompiledFormulas& program, const CompiledFormulas& part, int firstColumn) {
+
+    /* The same as joining the programs of the chunks in separateRows: the positions of the code, constants, ranges and groups are moved along. The code
+        already references the columns of the workbook, only the cells the formulas are in are moved over to their sheet's columns */
+
+    int codeBase = program.code.size(), constantBase = program.constants.size(), rangeBase = program.ranges.size(), groupBase = program.groups.size();
+    program.codeStart.pop_back();
+    for (int f = 0; f < part.row.size(); f++) {
+        program.row.push_back(part.row[f]);
+        program.column.push_back(part.column[f] + firstColumn);
+        program.codeStart.push_back(part.codeStart[f] + codeBase);
+        program.group.push_back(part.group[f] < 0 ? -1 : part.group[f] + groupBase);
+    }
+    program.codeStart.push_back(part.codeStart.back() + codeBase);
+
+    for (int k = 0; k < part.code.size(); k++) {
+        Instruction instruction = part.code[k];
+        if (instruction.op == OP_PUSH_CONSTANT) instruction.row += constantBase;
+        if (isRangeFunction(instruction.op)) instruction.row += rangeBase;
+        program.code.push_back(instruction);
+    }
+    program.constants.insert(program.constants.end(), part.constants.begin(), part.constants.end());
+    program.ranges.insert(program.ranges.end(), part.ranges.begin(), part.ranges.end());
+    for (int g = 0; g < part.groups.size(); g++) {
+        FormulaGroup group = part.groups[g];
+        group.column += firstColumn;
+        group.codeStart += codeBase;
+        group.codeEnd += codeBase;
+        program.groups.push_back(group);
+    }
+    program.maxStackDepth = max(program.maxStackDepth, part.maxStackDepth);
+}
+
+Sheet loadWorkbook(const string& fileName, int threadCount, Workbook& workbook) {
+
+    /* Sheet2 is the file Sheet2.txt if the input is Summary.txt - the directory and extension of the input file, with the name of the sheet */
+
+    size_t nameStart = fileName.find_last_of("/\\");
+    nameStart = nameStart == string::npos ? 0 : nameStart + 1;
+    size_t nameEnd = fileName.rfind('.');
+    if (nameEnd == string::npos || nameEnd < nameStart) nameEnd = fileName.size();
+    string directory = fileName.substr(0, nameStart), extension = fileName.substr(nameEnd);
+
+    /* Finds every sheet the input file reaches, tokenizing each one as it is found. A name without a file is only tried once, and left out of the workbook
+        (so references to it give #NAN) */
+
+    vector<SpreadsheetData> sheets;
+    unordered_set<string> tried;
+    workbook = Workbook();
+    workbook.names.push_back(fileName.substr(nameStart, nameEnd - nameStart));
+    tried.insert(workbook.names[0]);
+    sheets.push_back(getDataFromSpreadsheet(fileName, threadCount));
+
+    for (int k = 0; k < sheets.size(); k++) {
+        vector<string> names;
+        if (sheets[k].file) addReferencedSheets(sheets[k], names);
+        for (int n = 0; n < names.size(); n++) {
+            if (!tried.insert(names[n]).second) continue;
+            SpreadsheetData data = getDataFromSpreadsheet(directory + names[n] + extension, threadCount);
+            if (!data.file) continue;
+            workbook.names.push_back(names[n]);
+            sheets.push_back(move(data));
+        }
+    }
+
+    int rowCount = 0, columnCount = 0;
+    for (int k = 0; k < sheets.size(); k++) {
+        workbook.firstColumn.push_back(columnCount);
+        workbook.rowCount.push_back(sheets[k].rowStart.size() - 1);
+        workbook.columnCount.push_back(sheets[k].maxWidth);
+        rowCount = max(rowCount, workbook.rowCount[k]);
+        columnCount += sheets[k].maxWidth;
+    }
+
+    /* Every sheet is read like a file of its own, and then moved into the workbook's sheet: its columns go after those of the sheets before it, its formulas
+        after theirs, and its text is copied in (only the first sheet's text can stay in its mapped file). The first sheet becomes the workbook's sheet */
+
+    Sheet sheet;
+    for (int k = 0; k < sheets.size(); k++) {
+        sheets[k].workbook = &workbook;
+        sheets[k].sheet = k;
+        Sheet part = separateRows(sheets[k], threadCount);
+        sheets[k] = SpreadsheetData();
+
+        if (k == 0) {
+            sheet = move(part);
+            sheet.rowCount = rowCount;
+            sheet.columnCount = columnCount;
+            sheet.columns.resize(columnCount);
+            for (int j = 0; j < workbook.columnCount[0]; j++) padColumn(sheet.columns[j], rowCount);
+            continue;
+        }
+
+        vector<int> textIndex(part.texts.size());
+        for (int t = 0; t < part.texts.size(); t++) textIndex[t] = internText(sheet, textData(part, part.texts[t]), part.texts[t].length);
+
+        int formulaBase = sheet.formulas.row.size();
+        for (int j = 0; j < part.columnCount; j++) {
+            Column& cells = sheet.columns[workbook.firstColumn[k] + j];
+            cells = move(part.columns[j]);
+            for (int c = 0; c < cells.tags.size(); c++) {
+                if (tagKind(cells.tags[c]) == CELL_TEXT) cells.values[c] = textIndex[cells.values[c]];
+                if (!cells.formulas.empty() && cells.formulas[c] >= 0) cells.formulas[c] += formulaBase;
+            }
+            for (unordered_map<int, int>::iterator text = cells.numberTexts.begin(); text != cells.numberTexts.end(); ++text) text->second = textIndex[text->second];
+            padColumn(cells, rowCount);
+        }
+        appendFormulas(sheet.formulas, part.formulas, workbook.firstColumn[k]);
+    }
+    return sheet;
+}
+
+int runWorkbook(const Options& options) {
+
+    /* The phases are timed like a plain run's, except that every sheet is tokenized as it is found, so loading and tokenizing are timed together as load */
+
+    statisticsEnabled = options.stats;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Workbook workbook;
+    Sheet sheet = loadWorkbook(options.inputFileName, options.threadCount, workbook);
+    statistics.phases.load = secondsSince(start);
+
+    start = chrono::steady_clock::now();
+    convertFormulasToIntegers(sheet, options.threadCount);
+    statistics.phases.evaluate = secondsSince(start);
+
+    /* Only the first sheet is written out - the others were just loaded for what it references. The statistics still describe the whole workbook, whose
+        size is put back for them (they only read the formulas, not the columns) */
+
+    int rowCount = sheet.rowCount, columnCount = sheet.columnCount;
+    start = chrono::steady_clock::now();
+    sheet.rowCount = workbook.rowCount[0];
+    sheet.columnCount = workbook.columnCount[0];
+    sheet.columns.resize(sheet.columnCount);
+    if (!outputToFile(sheet, options.outputFileName, options.threadCount)) {
+        cerr << "Could not write " << options.outputFileName << endl;
+        return 1;
+    }
+    statistics.phases.write = secondsSince(start);
+
+    if (options.stats) {
+        sheet.rowCount = rowCount;
+        sheet.columnCount = columnCount;
+        printStatistics(sheet, options.topCount);
+    }
+    return 0;
+}
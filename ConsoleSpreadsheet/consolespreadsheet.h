@@ -1,61 +1,1020 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>     // Primary tool to store data from spreadsheet
+#include <climits>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+
 using namespace std;
 
-char delimiter = '\t';
-char ops[] = { '+', '-', '*', '/' };
+const char delimiter = '\t';
+const char ops[] = { '+', '-', '*', '/' };
+const int denseColumnFill = 4;     // a column is stored densely when at least 1 in denseColumnFill of its rows are filled
+const int parallelLevelWidth = 1024;    // levels with fewer formulas than this are evaluated by a single thread
+const int parallelChunkSize = 256;      // how many formulas a thread takes at a time from a level
+const long long outputChunkBytes = 1 << 20;     // roughly how much output each chunk of rows is formatted into before it is written
+const int kernelBlockRows = 256;        // how many rows of a formula group are evaluated at once by the column kernel
+const int rangeBlockRows = 256;         // how many rows of a column each leaf of a range tree summarizes
+const char snapshotMagic[8] = { 'C', 'S', 'S', 'N', 'A', 'P', 0, 0 };    // the first bytes of every snapshot file
+const int snapshotVersion = 4;          // increased whenever the layout of a snapshot changes
+const int batchQueueLength = 8;         // how many sheets can wait between two stages of a batch
+const int cacheRebuildShare = 4;        // when more than 1 in cacheRebuildShare rows have changed, the result cache is built again rather than updated
+const long long loadChunkBytes = 4 << 20;       // the least input a thread is given to tokenize and read into the sheet on its own
+const int bandCellBytes = 160;          // about how much memory every cell of a band takes while --memory-budget reads, evaluates and writes it
+const int neededCellBytes = 40;         // the same for every cell of another band loaded into a band's sheet for its formulas to reference
+const long long processBytes = 4 << 20;         // about how much memory the program takes before it has loaded anything
+
+#ifdef _WIN32
+const char lineEnding[] = "\r\n";
+#else
+const char lineEnding[] = "\n";
+#endif
+
+/* Errors a cell can hold instead of an integer. They are ordered so that when two errors meet in a formula the larger one wins (#NAN takes precidence over #ERROR) */
+enum CellError : unsigned char { CELL_OK = 0, CELL_ERROR = 1, CELL_NAN = 2 };
+
+/* What a cell contains. Every cell has a one byte tag: the kind is kept in the low 4 bits, and the high 4 bits hold the CellError a formula gets when it
+   references the cell - CELL_OK for numbers, CELL_NAN for empty and text cells, and the error of the result for formulas. */
+enum CellKind : unsigned char { CELL_EMPTY = 0, CELL_NUMBER = 1, CELL_TEXT = 2, CELL_FORMULA = 3 };
+
+inline unsigned char makeTag(CellKind kind, CellError error) { return (unsigned char)(kind | (error << 4)); }
+inline CellKind tagKind(unsigned char tag) { return (CellKind)(tag & 0x0F); }
+inline CellError tagError(unsigned char tag) { return (CellError)(tag >> 4); }
+
+/* The instructions a formula is compiled into. Formulas are stored in postfix order, so "=A1+B1*2" becomes PUSH_CELL A1, PUSH_CELL B1, PUSH_CONSTANT 2, MULTIPLY, ADD.
+   SUM, MIN, MAX and COUNT push the result of the function over a range of cells, so they are operands just like a cell */
+enum OpCode : unsigned char { OP_PUSH_CONSTANT, OP_PUSH_CELL, OP_PUSH_NAN, OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_SUM, OP_MIN, OP_MAX, OP_COUNT };
+
+inline bool isRangeFunction(OpCode op) { return op >= OP_SUM; }
+
+/* The arithmetic of formulas. A result too large for 64 bits wraps around (two's complement, as the processor does it) - overflowing a signed integer is
+   undefined in C++, so the operations are done on unsigned values and cast back. Dividing the smallest value by -1 wraps the same way, where the
+   division instruction itself would crash the program. wrapDivide must not be called with b == 0 */
+inline long long wrapAdd(long long a, long long b) { return (long long)((unsigned long long)a + (unsigned long long)b); }
+inline long long wrapSubtract(long long a, long long b) { return (long long)((unsigned long long)a - (unsigned long long)b); }
+inline long long wrapMultiply(long long a, long long b) { return (long long)((unsigned long long)a * (unsigned long long)b); }
+inline long long wrapDivide(long long a, long long b) { return b == -1 ? wrapSubtract(0, a) : a / b; }
+
+/* A single instruction. PUSH_CELL uses row and column of the referenced cell (already converted from A1 to indices), PUSH_CONSTANT keeps the index of its
+   constant in row and the range functions keep the index of their CellRange in row. The operators use neither. */
+struct Instruction {
+    OpCode op;
+    int row;
+    int column;
+};
+
+/* A rectangle of cells used by a range function, from (firstRow, firstColumn) to (lastRow, lastColumn) inclusive */
+struct CellRange {
+    int firstRow;
+    int lastRow;
+    int firstColumn;
+    int lastColumn;
+};
+
+/* An array that is either a vector of its own or a view of elements sitting in a mapped file, so that the arrays of a snapshot can be used right where they
+   are in the file instead of being copied out of it (see loadSnapshot). It is used just like the vector it stands in for. Reading and writing elements work
+   the same either way - a snapshot is mapped copy-on-write, so a write only ever changes this process's copy of a page - and anything that changes the size
+   first copies the elements into a vector of its own, as does copying the array. Moving it keeps the view, so whatever holds the mapping (the Sheet's
+   source) has to outlive it */
+template <class T>
+class MappedArray {
+public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    MappedArray() {}
+    MappedArray(size_t count, const T& value) : owned(count, value) { update(); }
+    MappedArray(const MappedArray& other) : owned(other.begin(), other.end()) { update(); }
+    MappedArray(MappedArray&& other) { *this = move(other); }
+
+    MappedArray& operator=(const MappedArray& other) {
+        if (this != &other) assign(other.begin(), other.end());
+        return *this;
+    }
+
+    MappedArray& operator=(MappedArray&& other) {
+        if (this == &other) return *this;
+        owned = move(other.owned);
+        mapped = other.mapped;
+        elements = mapped ? other.elements : owned.data();
+        count = other.count;
+        other.owned.clear();
+        other.mapped = false;
+        other.update();
+        return *this;
+    }
+
+    /* Makes the array a view of count elements at data, dropping whatever it held before */
+    void view(T* data, size_t size) {
+        vector<T>().swap(owned);
+        mapped = true;
+        elements = data;
+        count = size;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t capacity() const { return mapped ? count : owned.capacity(); }
+    T* data() { return elements; }
+    const T* data() const { return elements; }
+    T* begin() { return elements; }
+    T* end() { return elements + count; }
+    const T* begin() const { return elements; }
+    const T* end() const { return elements + count; }
+    T& operator[](size_t k) { return elements[k]; }
+    const T& operator[](size_t k) const { return elements[k]; }
+    T& front() { return elements[0]; }
+    const T& front() const { return elements[0]; }
+    T& back() { return elements[count - 1]; }
+    const T& back() const { return elements[count - 1]; }
+
+    void push_back(const T& value) { own(); owned.push_back(value); update(); }
+    void pop_back() { own(); owned.pop_back(); update(); }
+    void resize(size_t size) { own(); owned.resize(size); update(); }
+    void resize(size_t size, const T& value) { own(); owned.resize(size, value); update(); }
+    void reserve(size_t size) { own(); owned.reserve(size); update(); }
+    void shrink_to_fit() { own(); owned.shrink_to_fit(); update(); }
+    void clear() { mapped = false; owned.clear(); update(); }
+    void assign(size_t size, const T& value) { mapped = false; owned.assign(size, value); update(); }
+    template <class Iterator> void assign(Iterator first, Iterator last) { vector<T> copy(first, last); mapped = false; owned.swap(copy); update(); }
+
+    T* insert(const T* position, const T& value) {
+        size_t k = position - elements;
+        own();
+        owned.insert(owned.begin() + k, value);
+        update();
+        return elements + k;
+    }
+
+    template <class Iterator> T* insert(const T* position, Iterator first, Iterator last) {
+        size_t k = position - elements;
+        own();
+        owned.insert(owned.begin() + k, first, last);
+        update();
+        return elements + k;
+    }
+
+    T* erase(const T* first, const T* last) {
+        size_t k = first - elements, n = last - first;
+        own();
+        owned.erase(owned.begin() + k, owned.begin() + k + n);
+        update();
+        return elements + k;
+    }
+
+    T* erase(const T* position) { return erase(position, position + 1); }
+
+    void swap(MappedArray& other) {
+        MappedArray moved = move(other);
+        other = move(*this);
+        *this = move(moved);
+    }
+
+private:
+    vector<T> owned;
+    bool mapped = false;
+    T* elements = nullptr;
+    size_t count = 0;
+
+    void own() {
+        if (!mapped) return;
+        owned.assign(elements, elements + count);
+        mapped = false;
+    }
+
+    void update() {
+        elements = owned.data();
+        count = owned.size();
+    }
+};
+
+/* A formula filled down a column - rows firstRow .. firstRow + rowCount - 1 of the column all hold the same formula in relative (R1C1) form, each one
+   referencing the cells one row below the references of the formula above it. The code is only kept once, for the first row, in code[codeStart] ..
+   code[codeEnd - 1], and the formula in row firstRow + d runs that code with every reference moved down d rows */
+struct FormulaGroup {
+    int column;
+    int firstRow;
+    int rowCount;
+    int codeStart;
+    int codeEnd;
+};
+
+/* Every compiled formula of a sheet. Formula i sits in the cell at (row[i], column[i]) and its code is code[codeStart[i]] .. code[codeStart[i + 1] - 1], so
+   all of the formulas are stored one after another in a few vectors. row[i] is -1 for a formula that has since been removed from the sheet. group[i] is
+   the FormulaGroup formula i belongs to (-1 for none) - apart from the first one, the formulas of a group have no code of their own, so use formulaCode
+   rather than codeStart to find a formula's code */
+struct CompiledFormulas {
+    MappedArray<int> row;
+    MappedArray<int> column;
+    vector<Instruction> code;
+    MappedArray<long long> constants;
+    vector<CellRange> ranges;
+    MappedArray<int> codeStart = MappedArray<int>(1, 0);
+    MappedArray<int> group;
+    vector<FormulaGroup> groups;
+    int maxStackDepth = 1;      // the deepest any formula's stack can get, so the interpreter only has to allocate its stack once
+};
+
+/* The code a formula runs: code[begin] .. code[end - 1], with rowOffset added to the row of every cell it references */
+struct FormulaCode {
+    int begin;
+    int end;
+    int rowOffset;
+};
+
+inline FormulaCode formulaCode(const CompiledFormulas& program, int formula) {
+    int group = program.group[formula];
+    if (group < 0) return { program.codeStart[formula], program.codeStart[formula + 1], 0 };
+    const FormulaGroup& shared = program.groups[group];
+    return { shared.codeStart, shared.codeEnd, program.row[formula] - shared.firstRow };
+}
+
+/* One column of the sheet. values holds the integer of a number cell, the result of a formula cell once it has been evaluated, and the index into
+   Sheet::texts for a text cell. formulas holds the index of the formula in a formula cell and -1 everywhere else - it is left empty for columns without
+   any formulas, so a column of plain numbers costs 9 bytes per cell.
+
+   A dense column stores every row, so tags[row] is the tag of that row. A sparse column only stores its non-empty cells: rows lists their rows in
+   increasing order and tags[k], values[k] and formulas[k] belong to row rows[k]. Use cellIndex to find where a row is stored.
+
+   A number cell that was not written the way its integer is written back (007, -0) keeps its own text as well - numberTexts maps its row to the index of
+   that text in Sheet::texts, so the cell is written out exactly as it was read. Almost every column leaves it empty. */
+struct Column {
+    bool sparse = false;
+    MappedArray<int> rows;
+    MappedArray<unsigned char> tags;
+    MappedArray<long long> values;
+    MappedArray<int> formulas;
+    unordered_map<int, int> numberTexts;
+};
+
+/* Returns the position in the column's vectors where a row is stored, or -1 if it is not stored (an empty cell of a sparse column) */
+inline int cellIndex(const Column& column, int row) {
+    if (!column.sparse) return row;
+    const int* it = lower_bound(column.rows.begin(), column.rows.end(), row);
+    if (it == column.rows.end() || *it != row) return -1;
+    return it - column.rows.begin();
+}
+
+/* Returns the row of the cell stored at position k of the column */
+inline int storedRow(const Column& column, int k) {
+    return column.sparse ? column.rows[k] : k;
+}
+
+/* The non-empty cells of some rows of a sheet, starting at firstRow, listed row by row (see buildRowIndex). The cells of row firstRow + i are column[k] / index[k]
+   for k in rowStart[i] .. rowStart[i + 1] - 1, where index[k] is where the cell is stored within its column */
+struct RowIndex {
+    int firstRow = 0;
+    vector<long long> rowStart;
+    vector<int> column;
+    vector<int> index;
+};
+
+/* An input file mapped into memory (see MappedFile.cpp). It is unmapped when the last shared_ptr to it goes away */
+struct MappedFile {
+    const char* data = nullptr;
+    long long size = 0;
+#ifdef _WIN32
+    void* fileHandle = nullptr;
+    void* mappingHandle = nullptr;
+#endif
+
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+};
+
+/* A single non-empty cell of the input file - the cell's text is file->data[offset] .. file->data[offset + length - 1] */
+struct CellView {
+    long long offset;
+    int length;
+    int column;
+};
+
+/* The rows firstRow .. firstRow + rowCount - 1 of the input file, tokenized in one piece by tokenizeRows. filled[j] and formulas[j] count the filled cells
+   and the formulas in column j of these rows (the vectors are only as long as the widest of the rows) */
+struct TokenChunk {
+    int firstRow = 0;
+    int rowCount = 0;
+    vector<long long> filled;
+    vector<long long> formulas;
+};
+
+/* The sheets of a workbook (see Workbook.cpp), which are loaded side by side into the columns of one Sheet. Sheet k is named names[k] (its file name
+   without the extension), and its rowCount[k] rows and columnCount[k] columns take up the columns firstColumn[k] .. firstColumn[k] + columnCount[k] - 1 */
+struct Workbook {
+    vector<string> names;
+    vector<int> firstColumn;
+    vector<int> rowCount;
+    vector<int> columnCount;
+};
+
+/* The tokenized input file. The cells of row i are cells[rowStart[i]] .. cells[rowStart[i + 1] - 1], and maxWidth is the number of cells in the longest row.
+   chunks are the pieces the rows were tokenized in, in order */
+struct SpreadsheetData {
+    shared_ptr<MappedFile> file;
+    vector<CellView> cells;
+    vector<long long> rowStart;
+    int maxWidth = 0;
+    vector<TokenChunk> chunks;
+    const Workbook* workbook = NULL;    // the workbook the file is sheet number sheet of, if any - its formulas are then compiled with compileWorkbookFormula
+    int sheet = 0;
+};
+
+/* A text cell read by one of the threads of separateRows, waiting to be interned - it is cell slot of the column, and its text is at offset in the input file.
+   If number is set it is a number cell that keeps its own text instead (see Column::numberTexts), and slot is its row */
+struct PendingText {
+    int column;
+    int slot;
+    long long offset;
+    int length;
+    bool number;
+};
+
+/* Where the contents of a text cell are kept - in the mapped input file the sheet was loaded from if inSource is set, otherwise within Sheet::text */
+struct TextSpan {
+    long long offset;
+    int length;
+    bool inSource;
+};
+
+/* What the range functions need to know about the cells of part of a column: the sum, smallest and largest of its numbers (formula results count as
+   numbers), how many numbers there are, and the largest error of any formula in it. Empty and text cells are skipped */
+struct RangeSummary {
+    long long sum = 0;
+    long long min = LLONG_MAX;
+    long long max = LLONG_MIN;
+    long long count = 0;
+    CellError error = CELL_OK;
+};
+
+/* Segment trees over the columns that range functions cover (see Ranges.cpp), so that SUM(A1:A100000) does not have to visit every cell. A column is split
+   into blocks of rangeBlockRows rows; node 1 of a tree covers the whole column, the children of node i are 2i and 2i + 1, and the leaves leafCount ..
+   2 * leafCount - 1 are the blocks. Node i of tree t is range node t * 2 * leafCount + i, and every range node is also a node of the dependency graph,
+   numbered after the formulas - so the summaries are recalculated in order along with everything else */
+struct RangeIndex {
+    int leafCount = 0;
+    vector<int> treeOf;       // the tree of every column, or -1
+    vector<int> columnOf;     // the column of every tree
+    vector<RangeSummary> summaries;
+};
+
+/* The whole spreadsheet. Cells are stored column by column (sheet.columns[column]), so every column is a few contiguous arrays */
+struct Sheet {
+    int rowCount = 0;
+    int columnCount = 0;
+    vector<Column> columns;
+    shared_ptr<MappedFile> source;
+    string text;
+    vector<TextSpan> texts;
+    vector<int> textTable;    // every different text is kept once in texts (see internText)
+    CompiledFormulas formulas;
+    RangeIndex rangeIndex;
+};
+
+/* The dependency graph between the formula cells of a sheet. Every formula is a node (with the same index as in CompiledFormulas), and node i references
+   every formula cell that its formula points to. The nodes after the formulas are the range nodes of the sheet's RangeIndex. The references of node i are stored in references[referenceStart[i]] .. references[referenceStart[i + 1] - 1]
+   so the whole graph lives in two flat vectors. */
+struct DependencyGraph {
+    vector<int> referenceStart;
+    vector<int> references;
+};
+
+/* The formulas of a sheet grouped into levels: every formula references only formulas in lower levels. The formulas of level l are
+   formulas[levelStart[l]] .. formulas[levelStart[l + 1] - 1] */
+struct LevelSchedule {
+    vector<int> levelStart;
+    vector<int> formulas;
+};
+
+/* For every cell referenced by some formula, the formulas that reference it. cells is sorted, and the formulas referencing cells[k] are
+   formulas[start[k]] .. formulas[start[k + 1] - 1]. Range nodes are included like formulas, with the keys from rangeNodeKey */
+struct ReverseIndex {
+    vector<long long> cells;
+    vector<int> start;
+    vector<int> formulas;
+};
+
+/* What the result cache remembers of one input row (see Cache.cpp) - its length and two unrelated hashes of its contents, which all have to match for the
+   row to count as unchanged */
+struct RowHash {
+    long long length;
+    unsigned long long hash;
+    unsigned long long check;
+};
+
+/* A sheet kept in memory so that it can be edited and recalculated (see LiveSheet.cpp). position[n] is where graph node n comes in order, and changedCells
+   holds the keys of the cells edited (and range nodes reset) since the last recalculation. referencedBy is left empty until it is first needed */
+struct LiveSheet {
+    Sheet sheet;
+    int threadCount = 1;
+    DependencyGraph graph;
+    vector<int> order;
+    vector<char> circular;
+    vector<int> position;
+    ReverseIndex referencedBy;
+    vector<long long> changedCells;
+    bool structureChanged = false;
+    vector<RowHash> rowHashes;    // what is remembered of every input row, when the sheet is kept as a result cache (see Cache.cpp)
+};
+
+/* A what-if scenario over a calculated base sheet, which every scenario shares and none of them change (see Scenario.cpp). overrides are the keys of the
+   cells the scenario sets, with their tags and values. Once calculated, cells holds (sorted) the key of every cell the scenario has its own value for - the
+   overrides and every formula depending on them - with the tags and values to use instead of the base sheet's. A text cell's value is its index in texts */
+struct Scenario {
+    shared_ptr<const LiveSheet> base;
+    vector<long long> overrides;
+    unordered_map<long long, int> overrideIndex;    // where each overridden cell is in overrides
+    vector<unsigned char> overrideTags;
+    vector<long long> overrideValues;
+    vector<string> texts;
+    vector<long long> cells;
+    vector<unsigned char> tags;
+    vector<long long> values;
+    bool calculated = false;
+};
+
+/* The working memory of one thread evaluating formulas - the interpreter's stack, and for the group kernel one block of kernelBlockRows values for every
+   entry of the stack, plus the error of every row in the block */
+struct EvaluationScratch {
+    vector<long long> stack;
+    vector<long long> lanes;
+    vector<unsigned char> errors;
+};
+
+/* What the program has been asked to do - calculate a sheet and write the output (from a text file or a snapshot), turn a text file into a snapshot,
+   write a snapshot back out as text, generate a sheet, time the whole program on a sheet, calculate a whole list of sheets, calculate only a few cells or
+   report on the dependency graph of a sheet, or calculate a few cells in each of a list of scenarios */
+enum Command { COMMAND_RUN, COMMAND_IMPORT, COMMAND_EXPORT, COMMAND_GENERATE, COMMAND_BENCHMARK, COMMAND_BATCH, COMMAND_QUERY, COMMAND_ANALYZE, COMMAND_SCENARIOS };
+
+/* The kinds of sheet the generator makes (see Benchmark.cpp): random formulas on the rows above, one long chain of references, formulas adding up whole
+   rows and columns, the same formulas filled down every row, and random formulas with short cycles mixed in */
+enum SheetShape { SHAPE_MIXED, SHAPE_CHAIN, SHAPE_FANIN, SHAPE_FILLDOWN, SHAPE_CYCLES };
+
+/* The size and shape of a generated sheet. density is the percentage of cells that are filled */
+struct GeneratorOptions {
+    SheetShape shape = SHAPE_MIXED;
+    int rowCount = 100000;
+    int columnCount = 10;
+    int density = 100;
+    unsigned seed = 1;
+};
+
+/* A single cell of a sheet */
+struct CellPosition {
+    int row;
+    int column;
+};
+
+/* The settings given on the command line */
+struct Options {
+    Command command = COMMAND_RUN;
+    string inputFileName = "spreadsheet.txt";
+    string outputFileName = "output.txt";
+    bool inputFileGiven = false;
+    bool outputFileGiven = false;
+    int threadCount = 1;
+    GeneratorOptions generator;
+    int repeatCount = 3;
+    bool stats = false;
+    int topCount = 10;
+    long long memoryBudget = 0;    // in bytes - when set, the sheet is evaluated in bands of rows (see Banded.cpp)
+    vector<CellPosition> queryCells;    // the cells asked for with --cells
+    string graphFileName;               // where --analyze writes the dependency graph, if anywhere
+    string cacheFileName;               // where --cache keeps the results between runs, if anywhere
+    string scenarioFileName;            // the scenarios to calculate the --cells in, if any
+    bool workbook = false;              // the input is the first sheet of a workbook, whose other sheets are the files next to it
+};
+
+/* The rows firstRow .. lastRow */
+struct RowSpan {
+    int firstRow;
+    int lastRow;
+};
+
+/* A band of consecutive rows of the input file - bytes begin .. end - 1, holding cellCount filled cells - evaluated on its own by runBanded. needs holds
+   the rows of other bands that its formulas reference (sorted, without overlaps), and lastUse is the last band in evaluation order that needs this one. Once
+   the band is evaluated, values holds what is needed to reference its cells (the tag and value of every filled cell, with every column sparse) while it is
+   resident in memory; a band moved to the spill file is at spillOffset. outputOffset is where the band's formatted rows wait in the spill file if bands
+   above it are not written yet */
+struct RowBand {
+    long long begin = 0;
+    long long end = 0;
+    int firstRow = 0;
+    int rowCount = 0;
+    long long cellCount = 0;
+    vector<RowSpan> needs;
+    int lastUse = -1;
+    vector<Column> values;
+    bool resident = false;
+    long long residentBytes = 0;
+    long long spillOffset = -1;
+    long long outputOffset = -1;
+    long long outputLength = 0;
+};
+
+/* Where each row of an input file begins, found without reading any of its cells (see Query.cpp). Row i is bytes rowOffset[i] .. rowOffset[i + 1] - 1
+   of the file, including its line break. maxWidth is the width of the widest row, as in SpreadsheetData */
+struct LineIndex {
+    shared_ptr<MappedFile> file;
+    vector<long long> rowOffset;
+    int maxWidth = 0;
+};
+
+/* What --analyze finds out about the dependency graph of a sheet (see Analysis.cpp). fanOut[j][k] belongs to the cell stored at position k of column j */
+struct SheetAnalysis {
+    long long edgeCount = 0;
+    vector<int> criticalPath;           // the formulas of the longest chain, each referencing the one before it
+    vector<int> levelWidths;            // the number of nodes in every level of the evaluation schedule
+    vector<long long> fanIn;            // for every formula, the number of cells it reads
+    vector<vector<int>> fanOut;         // for every stored cell, the number of formulas that read it
+    vector<int> cycleCells;             // the formulas in cycles
+    vector<int> feedingCells;           // the formulas outside of cycles that a cycle depends on
+    long long affectedCount = 0;        // the formulas outside of cycles that depend on a cycle, and so become #ERROR
+};
+
+/* One file going through a batch, with the sheet read from it */
+struct BatchItem {
+    string inputFileName;
+    string outputFileName;
+    Sheet sheet;
+};
+
+/* The files waiting between two stages of a batch (see Batch.cpp). producers is the number of threads still adding to it - once it reaches 0 and the queue
+   is empty, there is nothing more to come */
+struct BatchQueue {
+    mutex lock;
+    condition_variable notEmpty;
+    condition_variable notFull;
+    deque<BatchItem> items;
+    int producers = 0;
+};
+
+/* How long each phase of the program took, in seconds */
+struct PhaseTimes {
+    double load = 0;
+    double tokenize = 0;
+    double evaluate = 0;
+    double write = 0;
+};
+
+/* What --stats counts (see Stats.cpp). Formulas evaluated one at a time and rows evaluated by the column kernel are counted apart, a range node hit is a
+   whole block of cells summarized by a range tree node instead of being read again, and the allocations are every use of operator new */
+enum Counter {
+    COUNTER_FORMULAS, COUNTER_GROUP_ROWS, COUNTER_GROUP_BLOCKS, COUNTER_INSTRUCTIONS, COUNTER_CIRCULAR, COUNTER_RANGE_NODES, COUNTER_RANGE_NODE_HITS,
+    COUNTER_RANGE_CELLS, COUNTER_ALLOCATIONS, COUNTER_ALLOCATED_BYTES, COUNTER_COUNT
+};
+
+/* Everything --stats reports. formulaSeconds and formulaEvaluations are kept for every node of the dependency graph - each node is only ever evaluated by one
+   thread at a time, so they need no locking */
+struct Statistics {
+    atomic<long long> counters[COUNTER_COUNT];
+    PhaseTimes phases;
+    double rangeIndexSeconds = 0;
+    double graphSeconds = 0;
+    double orderSeconds = 0;
+    double cellSeconds = 0;
+    int maxDepth = 0;
+    vector<double> formulaSeconds;
+    vector<int> formulaEvaluations;
+};
+
+/* Set by --stats. Nothing is counted or timed unless it is */
+extern bool statisticsEnabled;
+extern Statistics statistics;
+
+/* The fixed size start of a snapshot file. byteOrder is written as 0x01020304, so a snapshot from a machine with the other byte order is recognized */
+struct SnapshotHeader {
+    char magic[8];
+    int version;
+    int byteOrder;
+    int rowCount;
+    int columnCount;
+};
+
+/* Reads the command line into options, returning false (after printing the usage) if it cannot be understood */
+bool parseOptions(int argc, char* argv[], Options& options);
+
+/* Maps the file fileName into memory, returning nullptr if it cannot be opened */
+shared_ptr<MappedFile> mapFile(const string& fileName);
+
+/* The same as mapFile, but the mapping can be written to - copy-on-write, so the writes only change this process's copy and never reach the file */
+shared_ptr<MappedFile> mapFileCopyOnWrite(const string& fileName);
+
+/* Tells the operating system that bytes begin .. end - 1 of a mapped file will not be read again, so their pages can be dropped from memory */
+void releaseFileRange(const MappedFile& file, long long begin, long long end);
+
+/* Creates a new empty file with a unique name (starting with prefix) in the system's temporary directory and returns its name, or "" if it could not */
+string temporaryFile(const char* prefix);
+
+/* Maps the input file fileName and separates it into rows and cells, without copying any of the cells. A large file is split into chunks of rows that
+   are tokenized by up to threadCount threads at once */
+SpreadsheetData getDataFromSpreadsheet(const string& fileName, int threadCount);
+
+/* Separates the bytes begin .. end - 1 of data.file (which must start at the start of a row, and end at the end of one) into rows and cells, adding them
+   to data as one more chunk */
+void tokenizeRows(SpreadsheetData& data, long long begin, long long end);
+
+/* Takes each individual cell from the spreadsheet and stores it in the typed sheet, reading up to threadCount of the chunks of data at once */
+Sheet separateRows(const SpreadsheetData& data, int threadCount);
+
+/* Creates an empty sheet with the given number of rows and columns. Every column starts out sparse */
+Sheet createSheet(int rowCount, int columnCount);
+
+/* Switches a column to dense storage, used for columns that are (or are going to be) mostly filled */
+void makeColumnDense(Sheet& sheet, int column);
+
+/* Makes room for a row in a column, returning the position the cell is stored at */
+int storeCell(Column& cells, int row);
 
-/* Takes the input file fileName and separates it by rows into a vector<string> */
-vector<string> getDataFromSpreadsheet(const string& fileName);
+/* Lists the non-empty cells of rows firstRow .. endRow - 1 of the sheet in row order, in time proportional to the number of filled cells */
+RowIndex buildRowIndex(const Sheet& sheet, int firstRow, int endRow);
 
-/* Takes each individual row from the spreadsheet and separates them into cells */
-vector<vector<string>> separateRows(const vector<string>& rows);
+/* Stores the contents of a single cell (s, of the given length) in the sheet as a number, text or a compiled formula. Must be called on an empty cell.
+   Text that lies within sheet.source is referenced in place, anything else is copied into sheet.text */
+void setCellContents(Sheet& sheet, int row, int column, const char* s, int length);
 
-/* Used to aid separateRows method, takes an individual row and separates it into its cells */
-vector<string> separateRowIntoCells(const string& s);
+/* Returns the index in sheet.texts of the text s (of the given length), adding it if the sheet does not hold that text yet */
+int internText(Sheet& sheet, const char* s, int length);
 
-/* Checks that any given string contains the delimiter '\t', used to tokenize a row into its cells */
-bool containsDelimiter(const string& s);
+/* Returns the 64 bit FNV-1a hash of s (of the given length) */
+unsigned long long hashText(const char* s, int length);
 
-/* Converts all formulas in the spreadsheet into the integers they represent*/
-void convertFormulasToIntegers(vector<vector<string>>& sheet);
+/* Returns the contents of a text cell */
+const char* textData(const Sheet& sheet, const TextSpan& span);
 
-/* Takes a single formla string and converts it into its expected value (helps convertFormulaToIntegers) */
-string convertFormula(const vector<vector<string>>& sheet, string s, const int& currentRow, const int& currentCol);
+/* Empties a single cell. A formula in the cell is marked as removed */
+void clearCell(Sheet& sheet, int row, int column);
 
-/*Used for formatting the formula, removes spaces so that "A1   + B3" can still be read */
-void removeSpaces(string& s);
+/* Returns a cell's value as it is written to the output - an integer, text, #NAN or #ERROR, or "" for an empty cell */
+string formatCell(const Sheet& sheet, int row, int column);
 
-/* Takes two values and performs the correct operation on them */
-string performOperation(const string& firstCell, const string& secondCell, const char& firstOperator);
+/* Returns the name of a cell as it is written in a formula (row 0, column 27 is AB1) */
+string cellName(int row, int column);
 
-/* Extract the operators out of a formula and return the vector<char> of those operators */
-vector<char> getOperators(const string& s);
+/* A single number identifying a cell, used to sort and look up cells */
+inline long long cellKey(const Sheet& sheet, int row, int column) { return (long long)column * sheet.rowCount + row; }
 
-/* Extract the cell identifiers (A1, B4, etc) out of the formlua and returns the vector<string> of those identifiers */
-vector<string> getIdentifiers(const string& s);
+/* The same for range nodes - their keys come after the keys of every cell */
+inline long long rangeNodeKey(const Sheet& sheet, int node) { return (long long)sheet.rowCount * sheet.columnCount + node; }
 
-/* Checks that all cell identifiers within a formula reference non-zero, existing cells */
-bool validIdentifiers(const vector<string>& cellIdentifiers, const vector<vector<string>>& sheet);
+/* Returns the index of the formula in a cell, or -1 if the cell does not contain a formula */
+int formulaAt(const Sheet& sheet, int row, int column);
 
-/* Ensures that a cell does not contain an identifier to itself */
-bool circularReference(const vector<string>& cellIdentifiers, const vector<vector<string>>& sheet, const int&, const int& currentColumn);
+/* Converts all formulas in the spreadsheet into the integers they represent, using up to threadCount threads*/
+void convertFormulasToIntegers(Sheet& sheet, int threadCount);
 
-/* In any given vector<char> of operators from a formula, finds the location of the first multiplication or division sign (allows for precidence in operations) */
-int indexOfMultDiv(const vector<char>& operators);
+/* Evaluates a single node of the dependency graph - a formula cell, whose value (or #ERROR if it is part of a cycle) is stored in the sheet, or a range node */
+void evaluateFormulaCell(Sheet& sheet, int formula, bool circular, long long* stack);
 
-/* Checks that a formula contains an identifier to distinguish it from an integer or a simple data copy (=1, =A4) */
-bool containsIdentifier(const string& s);
+/* Evaluates formulas[begin] .. formulas[end - 1], none of which may reference another. Consecutive rows of a formula group are evaluated together by the
+   column kernel, everything else one cell at a time */
+void evaluateFormulaRange(Sheet& sheet, const vector<int>& formulas, int begin, int end, const vector<char>& circular, EvaluationScratch& scratch);
 
-/* Takes a cell identifier and outputs the index of the row it references (A4 references row 4, outputs an index of 3) */
-int getRow(const string& s);
+/* Allocates the working memory for evaluating the formulas of a sheet */
+EvaluationScratch createScratch(const Sheet& sheet);
 
-/* Takes a cell identifier and outputs the index of the column it references (B5 references column 2, outputs an index of 1) */
-int getColumn(const string& s);
+/* Groups the formulas into levels that can each be evaluated all at once. Within a level the formulas of a group are put next to each other in row order */
+LevelSchedule scheduleLevels(const DependencyGraph& graph, const vector<int>& order, const CompiledFormulas& program);
 
-/* Checks if a string is a number or not - used to distinguish when a formula references a cell or uses a constant integer */
-bool isNumber(const string& s);
+/* Evaluates the formulas in order (which may be only some of the sheet's formulas) level by level, sharing the cells of each level between threadCount threads */
+void evaluateFormulas(Sheet& sheet, const DependencyGraph& graph, const vector<int>& order, const vector<char>& circular, int threadCount);
+
+/* Decides which columns need range trees for the range functions in the sheet's formulas, and numbers their nodes. Returns true if the trees have changed,
+   in which case none of the summaries have been calculated yet */
+bool buildRangeIndex(Sheet& sheet);
+
+/* Appends the keys (cellKey or rangeNodeKey) of everything a range function over range (moved down rowOffset rows) reads: the cells at either end of the
+   range that do not fill a whole block, and the range nodes covering the rest */
+void rangeReferences(const Sheet& sheet, const CellRange& range, int rowOffset, vector<long long>& keys);
+
+/* Appends the keys of everything a range node reads - the cells of its block for a leaf, otherwise its two children */
+void rangeNodeReferences(const Sheet& sheet, int node, vector<long long>& keys);
+
+/* Recalculates the summary of a range node from the cells or nodes it covers. A node that is part of a cycle gets #ERROR */
+void updateRangeNode(Sheet& sheet, int node, bool circular);
+
+/* Summarizes the cells of range (moved down rowOffset rows), using the range trees for whole blocks */
+RangeSummary summarizeRange(const Sheet& sheet, const CellRange& range, int rowOffset);
+
+/* Adds a single cell to a summary */
+void addToSummary(RangeSummary& summary, unsigned char tag, long long value);
+
+/* Combines two summaries into one covering both */
+RangeSummary combineSummaries(const RangeSummary& a, const RangeSummary& b);
+
+/* Returns the result of a range function (SUM, MIN, MAX or COUNT) from the summary of its range. MIN and MAX of a range without any numbers are #NAN */
+long long rangeFunctionValue(OpCode op, const RangeSummary& summary, CellError& error);
+
+/* Builds the dependency graph of the sheet from the references in its compiled formulas */
+DependencyGraph buildDependencyGraph(const Sheet& sheet);
+
+/* Returns the graph node with the given key (see cellKey and rangeNodeKey) - the formula in a cell or a range node - or -1 for a cell without a formula */
+int nodeAtKey(const Sheet& sheet, long long key);
+
+/* Orders the nodes of the graph so that every formula comes after all of the formulas it references, and marks in circular every node that is part of a cycle */
+vector<int> topologicalOrder(const DependencyGraph& graph, vector<char>& circular);
+
+/* Takes ownership of a sheet and calculates every formula in it, ready for editing */
+LiveSheet openLiveSheet(Sheet sheet, int threadCount);
+
+/* Rebuilds the dependency graph, evaluation order and reverse edges of a live sheet after formulas have been added or removed */
+void rebuildDependencies(LiveSheet& live);
+
+/* Builds the reverse edges of a live sheet (live.referencedBy) from its compiled formulas and range trees */
+void buildReverseIndex(LiveSheet& live);
+
+/* Changes the contents of a cell (a number, text, a formula or "" to empty it). Nothing is recalculated until a value is read or recalculate is called.
+   Returns false if the cell is outside of the sheet */
+bool setCell(LiveSheet& live, int row, int column, const string& contents);
+
+/* Returns the value of a cell as it would be written to the output, first recalculating if any cells have been changed */
+string getCellValue(LiveSheet& live, int row, int column);
+
+/* Evaluates again every formula that depends on a cell changed since the last recalculation */
+void recalculate(LiveSheet& live);
+
+/* Starts a scenario with no changes over base, which must be calculated and have its reverse edges built. A scenario is forked by copying it */
+Scenario createScenario(shared_ptr<const LiveSheet> base);
+
+/* Overrides a cell in a scenario with a number, text or "" to empty it. Returns false if the cell is outside of the sheet or contents is a formula */
+bool setScenarioCell(Scenario& scenario, int row, int column, const string& contents);
+
+/* Evaluates every formula of the base sheet that depends on a cell the scenario overrides, keeping the results in the scenario */
+void calculateScenario(Scenario& scenario);
+
+/* Returns the value of a cell in a scenario as it would be written to the output, first calculating the scenario if needed */
+string getScenarioValue(Scenario& scenario, int row, int column);
+
+/* Compiles a single formula (s, with its leading '=') into postfix instructions, appending them to program. Returns the depth of stack the formula needs */
+int compileFormula(const char* s, int length, int rowCount, int columnCount, CompiledFormulas& program);
+
+/* Compiles a single formula of sheet number sheet of a workbook, where references can also point into the other sheets (like Sheet2!B7). Every reference
+   is compiled to the columns its sheet is loaded into */
+int compileWorkbookFormula(const char* s, int length, const Workbook& workbook, int sheet, CompiledFormulas& program);
+
+/* Runs the compiled code of one formula on the current cell values (the stack machine). stack must have room for maxStackDepth values */
+long long runFormula(const Sheet& sheet, int formula, long long* stack, CellError& error);
+
+/* Reads the cells of a sheet for runFormulaCode - cell returns false for a cell that is not stored at all, and range summarizes a range moved down
+   rowOffset rows */
+struct SheetCellReader {
+    const Sheet& sheet;
+    bool cell(int row, int column, unsigned char& tag, long long& value) const;
+    RangeSummary range(const CellRange& range, int rowOffset) const;
+};
+
+/* Reads the cells of a scenario for runFormulaCode - its own values where it has them, and the base sheet's everywhere else (see Scenario.cpp) */
+struct ScenarioCellReader {
+    const Scenario& scenario;
+    bool cell(int row, int column, unsigned char& tag, long long& value) const;
+    RangeSummary range(const CellRange& range, int rowOffset) const;
+};
+
+/* Runs the compiled code of one formula of program, reading its operands through reader (a SheetCellReader, or anything with the same cell and range) */
+template <class CellReader>
+long long runFormulaCode(const CompiledFormulas& program, int formula, const CellReader& reader, long long* stack, CellError& error) {
+
+    /* A simple stack machine. Operands push their value, operators pop the top two values and push the result. Errors do not need their own stack: any
+        error in any operand makes the whole formula that error, so error just keeps the largest one seen (#NAN beats #ERROR). The tag of every cell
+        already holds the error a reference to it gives, so reading an operand is the same whatever the cell contains. */
+
+    FormulaCode code = formulaCode(program, formula);
+    int top = 0;
+    for (int k = code.begin; k < code.end; k++) {
+        const Instruction& instruction = program.code[k];
+
+        switch (instruction.op) {
+        case OP_PUSH_CONSTANT:
+            stack[top++] = program.constants[instruction.row];
+            break;
+        case OP_PUSH_CELL: {
+            unsigned char tag;
+            long long value;
+            if (!reader.cell(instruction.row + code.rowOffset, instruction.column, tag, value)) {
+                error = CELL_NAN;    // an empty cell that is not stored at all
+                stack[top++] = 0;
+                break;
+            }
+
+            CellError cellError = tagError(tag);
+            if (cellError > error) error = cellError;
+            stack[top++] = value;
+            break;
+        }
+        case OP_PUSH_NAN:
+            error = CELL_NAN;
+            stack[top++] = 0;
+            break;
+        case OP_SUM:
+        case OP_MIN:
+        case OP_MAX:
+        case OP_COUNT:
+            stack[top++] = rangeFunctionValue(instruction.op, reader.range(program.ranges[instruction.row], code.rowOffset), error);
+            break;
+        case OP_ADD:
+            top--;
+            stack[top - 1] = wrapAdd(stack[top - 1], stack[top]);
+            break;
+        case OP_SUBTRACT:
+            top--;
+            stack[top - 1] = wrapSubtract(stack[top - 1], stack[top]);
+            break;
+        case OP_MULTIPLY:
+            top--;
+            stack[top - 1] = wrapMultiply(stack[top - 1], stack[top]);
+            break;
+        case OP_DIVIDE:
+            top--;
+            if (stack[top] == 0) {
+                error = CELL_NAN;    // dividing by zero does not give a number
+                stack[top - 1] = 0;
+            }
+            else stack[top - 1] = wrapDivide(stack[top - 1], stack[top]);
+            break;
+        }
+    }
+
+    if (error != CELL_OK) return 0;
+    return stack[0];
+}
+
+/* Called while a sheet is loaded, right after formula (the last one compiled) is stored. If it is the formula above it filled down, it joins that formula's
+   FormulaGroup and its own code is dropped. formulaAbove holds the last formula stored in each column */
+void groupFilledFormula(CompiledFormulas& program, int formula, vector<int>& formulaAbove);
+
+/* Checks if formula below (which must have code of its own) is formula above filled down one row - the same code with every reference one row further down */
+bool isFilledDown(const CompiledFormulas& program, int above, int below);
+
+/* The column kernel: runs the code of a formula group for rowCount (at most kernelBlockRows) consecutive members starting at firstRow, a whole block of rows
+   per instruction. The results are left in scratch.lanes[0 .. rowCount - 1] and their errors in scratch.errors */
+void runFormulaGroup(const Sheet& sheet, int group, int firstRow, int rowCount, EvaluationScratch& scratch);
+
+/* Adds, subtracts or multiplies count values of b into a, using AVX2 or SSE2 when the processor has them */
+void addVectors(long long* a, const long long* b, int count);
+void subtractVectors(long long* a, const long long* b, int count);
+void multiplyVectors(long long* a, const long long* b, int count);
+
+/* Raises each of count errors to the error held in the matching tag, if that one is larger */
+void mergeTagErrors(unsigned char* errors, const unsigned char* tags, int count);
+
+/* Checks (once) whether the processor and operating system support AVX2 */
+bool cpuSupportsAvx2();
+
+/* Checks (once) whether the processor supports SSE4.1 (and SSSE3) */
+bool cpuSupportsSse41();
+
+/* Checks that s[0] .. s[length - 1] is a number, the same as isNumber, and if so reads it into value - validating and converting short numbers with SSE2
+   and SSE4.1 where the processor has them. Returns false for a number outside of the 64 bit range */
+bool parseNumber(const char* s, int length, long long& value);
+
+/* Checks if s[i] starts the name of a function - letters followed by '(' - rather than a cell identifier */
+bool isRangeFunctionName(const char* s, int length, int i);
+
+/* Reads a range function (SUM(A1:B10), min(c3:c7), COUNT(A1), ...) starting at s[i], moving i past it. Outputs the function and the range, with its
+   corners in order, and returns false if s[i] does not start a valid range function */
+bool parseRangeFunction(const char* s, int length, int& i, OpCode& op, CellRange& range, string& sheetName);
+
+/* Reads a cell identifier (A1, ab12, etc) starting at s[i], moving i past it. Outputs the indices of the row and column it references (B5 is row 4, column 1) and
+   returns false if s[i] does not start a valid identifier */
+bool parseCellIdentifier(const char* s, int length, int& i, int& row, int& column);
+
+/* Reads the digits starting at s[i] as an integer, moving i past them. A number too large for 64 bits is read as LLONG_MAX */
+long long parseInteger(const char* s, int length, int& i);
+
+/* Checks if a string is a number or not (digits, with an optional '-' in front) - used to distinguish when a cell holds an integer or a text value */
+bool isNumber(const char* s, int length);
+
+/* Checks if a number (one that isNumber accepts) is written exactly the way its integer is written back out - no leading zeros and no "-0" */
+bool isCanonicalNumber(const char* s, int length);
 
 /* Checks if a character is one of the 4 operators */
 bool isOperator(const char& c);
 
-/* Outputs the formatted spreadsheet to output.txt */
-void outputToFile(const vector<vector<string>>& sheet, const string& outputFileName);
\ No newline at end of file
+/* Writes a calculated live sheet to a snapshot file - its cells, compiled formulas, range trees and dependency graph as flat arrays. Returns false if the
+   file cannot be written */
+bool saveSnapshot(const LiveSheet& live, const string& fileName);
+
+/* Loads a snapshot written by saveSnapshot. The sheet's text cells are left in the mapped file. Returns false if the file cannot be read or is not a
+   snapshot of this version */
+bool loadSnapshot(const string& fileName, LiveSheet& live);
+
+/* Checks if a file starts like a snapshot */
+bool isSnapshotFile(const string& fileName);
+
+/* Writes a sheet of the given size and shape to fileName, returning false if the file cannot be written. The same options always give the same sheet */
+bool generateSheet(const GeneratorOptions& generator, const string& fileName);
+
+/* Reads the name of a sheet shape (mixed, chain, fanin, filldown or cycles), returning false if there is no such shape */
+bool parseShape(const string& name, SheetShape& shape);
+
+/* Times every phase of the program on the input file (or on a generated sheet if none was given) options.repeatCount times, and prints the results as JSON.
+   Returns the exit code of the program */
+int runBenchmark(const Options& options);
+
+/* Evaluates the input file in bands of rows, holding no more than about options.memoryBudget bytes in memory, and writes the output as it goes. Returns
+   the exit code of the program */
+int runBanded(const Options& options);
+
+/* Lists the files of a batch - every file in source if it is a directory, otherwise the file names listed in source, one per line. Returns false if source
+   cannot be read */
+bool listBatchInputs(const string& source, vector<string>& inputs);
+
+/* Adds a file to a batch queue, first waiting for room if the queue is full */
+void pushBatchItem(BatchQueue& queue, BatchItem& item);
+
+/* Takes the next file from a batch queue, waiting for one if needed. Returns false once every producer has finished and the queue is empty */
+bool popBatchItem(BatchQueue& queue, BatchItem& item);
+
+/* Called by each producer of a batch queue when it has nothing more to add */
+void finishBatchProducer(BatchQueue& queue);
+
+/* Calculates every file listed in options.inputFileName (see listBatchInputs), writing each output to the directory options.outputFileName under the same
+   name as its input. Returns the exit code of the program */
+int runBatch(const Options& options);
+
+/* Calculates the input file using the results kept in options.cacheFileName by the last run, evaluating again only what depends on rows that have changed
+   since, and then updates the cache. Returns the exit code of the program */
+int runCached(const Options& options);
+
+/* Maps an input file and finds where each of its rows begins, and how wide the sheet is */
+LineIndex indexLines(const string& fileName);
+
+/* Finds the text of a cell in the file indexed by lines. Returns false if the cell is empty or outside of the sheet */
+bool findCell(const LineIndex& lines, int row, int column, const char*& s, int& length);
+
+/* Calculates only the given cells of an input file, reading, compiling and evaluating nothing but the cells they depend on. Returns the formatted value of
+   every cell, in the same order (empty for an empty cell) */
+vector<string> queryCells(const string& fileName, const vector<CellPosition>& cells, int threadCount);
+
+/* Reads a list of cells separated by commas, like C3,D10. Returns false if one of them is not a cell */
+bool parseCellList(const string& list, vector<CellPosition>& cells);
+
+/* Loads the sheet in fileName and every sheet it references (directly or through other sheets) into one Sheet, with workbook telling where each of them
+   went. The sheet named Sheet2 is read from Sheet2 with the same extension and directory as fileName. Sheets nothing references are never read */
+Sheet loadWorkbook(const string& fileName, int threadCount, Workbook& workbook);
+
+/* Calculates the input file as the first sheet of a workbook, and writes it to the output file. Returns the exit code of the program */
+int runWorkbook(const Options& options);
+
+/* Calculates the cells options.queryCells in every scenario listed in options.scenarioFileName, over the input file as the base sheet, and prints them as
+   a table. Returns the exit code of the program */
+int runScenarios(const Options& options);
+
+/* Returns the name of a node of the dependency graph - the cell of a formula, or the cells a range node summarizes (like A1:A256). Returns an empty string
+   for a removed formula or a range node that is never used */
+string graphNodeName(const Sheet& sheet, int node);
+
+/* Finds the critical path, level widths, fan-in and fan-out and the cycles of a sheet's dependency graph, in time linear in the size of the graph */
+SheetAnalysis analyzeSheet(const Sheet& sheet, const DependencyGraph& graph, const vector<int>& order, const vector<char>& circular);
+
+/* Prints an analysis as JSON, naming the topCount cells with the most fan-in and fan-out */
+void printAnalysis(const Sheet& sheet, const SheetAnalysis& analysis, int topCount);
+
+/* Writes the dependency graph to fileName - in the DOT language of Graphviz if the name ends in .dot, otherwise as JSON. Returns false if it cannot be
+   written */
+bool writeGraph(const Sheet& sheet, const DependencyGraph& graph, const string& fileName);
+
+/* Reads the input file and prints an analysis of its dependency graph, writing the graph to options.graphFileName if one was given. Returns the exit code
+   of the program */
+int runAnalysis(const Options& options);
+
+/* Returns the most memory the process has used so far, in bytes, or 0 if it cannot be found out */
+long long peakMemoryUsage();
+
+/* Returns the seconds passed since start */
+double secondsSince(chrono::steady_clock::time_point start);
+
+/* Makes room for the timings of nodeCount graph nodes in statistics */
+void prepareStatistics(int nodeCount);
+
+/* Records one evaluation of a graph node (a formula or a range node) that took the given time */
+void countEvaluation(const Sheet& sheet, int node, bool circular, double seconds);
+
+/* Records one block of the column kernel - the rowCount formulas formulas[first] .. formulas[first + rowCount - 1] of a group - that took the given time */
+void countGroupBlock(const Sheet& sheet, const vector<int>& formulas, int first, int rowCount, double seconds);
+
+/* Returns the length of the longest chain of formulas that each reference the one before, leaving out cells that are part of a cycle */
+int dependencyDepth(const DependencyGraph& graph, const vector<int>& order, const vector<char>& circular);
+
+/* Prints everything in statistics as JSON, including the topCount formulas that took longest to evaluate */
+void printStatistics(const Sheet& sheet, int topCount);
+
+/* Outputs the formatted spreadsheet to output.txt, formatting the rows with up to threadCount threads. Returns false if the file could not be written */
+bool outputToFile(const Sheet& sheet, const string& outputFileName, int threadCount);
+
+/* Formats rows firstRow .. endRow - 1 of the sheet, appending them to buffer */
+void formatRows(const Sheet& sheet, const RowIndex& index, int firstRow, int endRow, string& buffer);
+
+/* Writes the digits of value to out, returning how many characters were written (at most 20) */
+int formatInteger(long long value, char* out);